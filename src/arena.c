@@ -0,0 +1,127 @@
+/*
+ * arena - per-command bump allocator
+ * everything the parser hands out for one input line
+ * (argument vectors, redirect targets, job command lines)
+ * lives here and is released in one step by arena_reset
+ *
+ * @author Monthon Paul
+ * @version March 11, 2024
+ */
+#include "mpsh.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+/**
+ * @brief Get a fresh block from the system big enough for n bytes.
+ * @param a the arena
+ * @param n bytes needed
+ * @return the new block, chained in front of the arena's blocks
+ */
+static arena_block_t *arena_newblock(arena_t *a, size_t n) {
+    size_t size = MPSH_ARENA_BLOCK;
+    while (size < n)
+        size <<= 1;
+    arena_block_t *b = malloc(sizeof(arena_block_t) + size);
+    if (!b) {
+        fprintf(stderr, "mpsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    b->size = size;
+    b->used = 0;
+    b->next = a->head;
+    a->head = b;
+    a->nsys++;
+    return b;
+}
+
+/**
+ * @brief Allocate n bytes from the arena (uninitialized).
+ * @param a the arena
+ * @param n size in bytes
+ * @return pointer valid until the next arena_reset
+ */
+void *arena_alloc(arena_t *a, size_t n) {
+    arena_block_t *b = a->head;
+    n = ARENA_ROUND(n);
+    if (!b || b->size - b->used < n)
+        b = arena_newblock(a, n);
+    void *p = b->data + b->used;
+    b->used += n;
+    a->last = p;
+    a->nalloc++;
+    return p;
+}
+
+/**
+ * @brief Resize an arena allocation, in place when it is the latest one.
+ * @param a the arena
+ * @param p previous allocation (or NULL)
+ * @param old previous size in bytes
+ * @param n new size in bytes
+ * @return pointer to the resized memory, contents preserved
+ */
+void *arena_grow(arena_t *a, void *p, size_t old, size_t n) {
+    arena_block_t *b = a->head;
+    if (p && p == a->last && (char *)p + ARENA_ROUND(n) <= b->data + b->size) {
+        b->used = ((char *)p - b->data) + ARENA_ROUND(n);
+        return p;
+    }
+    void *q = arena_alloc(a, n);
+    if (p)
+        memcpy(q, p, old < n ? old : n);
+    return q;
+}
+
+/**
+ * @brief Copy a string into the arena.
+ * @param a the arena
+ * @param s the string
+ * @return arena owned copy
+ */
+char *arena_strdup(arena_t *a, const char *s) {
+    size_t len = strlen(s) + 1;
+    return memcpy(arena_alloc(a, len), s, len);
+}
+
+/**
+ * @brief Release everything allocated since the last reset.
+ * If the line spilled over several blocks, they are merged into
+ * one so the next line of the same size needs no system allocation.
+ * @param a the arena
+ */
+void arena_reset(arena_t *a) {
+    arena_block_t *b = a->head;
+    if (!b)
+        return;
+    if (b->next) {
+        size_t total = 0;
+        while (b) {
+            arena_block_t *next = b->next;
+            total += b->size;
+            free(b);
+            b = next;
+        }
+        a->head = NULL;
+        arena_newblock(a, total);
+    }
+    a->head->used = 0;
+    a->last = NULL;
+}
+
+/**
+ * @brief Free all memory held by the arena.
+ * @param a the arena
+ */
+void arena_free(arena_t *a) {
+    while (a->head) {
+        arena_block_t *next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+    a->last = NULL;
+}
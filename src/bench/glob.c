@@ -0,0 +1,91 @@
+/*
+ * glob - mpsh_glob against glob(3)
+ * fills a directory with N files (once), expands a few patterns
+ * over it both ways and prints the time of each as CSV. The last
+ * row is a line with two patterns over the same directory, which
+ * mpsh reads once
+ *
+ * usage: bench/glob [N [DIR]]   (default 100000, $TMPDIR/mpsh-glob)
+ *
+ * @author Monthon Paul
+ * @version March 11, 2024
+ */
+#include "../mpsh.h"
+
+#include <glob.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/* now - monotonic time in milliseconds */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* fill - Create the files, unless an earlier run did */
+static void fill(const char *dir, int n) {
+    char path[1100];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/f%07d.log", dir, n - 1);
+    if (stat(path, &st) == 0)
+        return;
+    mkdir(dir, 0755);
+    for (int i = 0; i < n; i++) {
+        snprintf(path, sizeof(path), "%s/f%07d.%s", dir, i, i % 2 ? "log" : "txt");
+        close(open(path, O_WRONLY | O_CREAT, 0644));
+    }
+}
+
+int main(int argc, char **argv) {
+    int n = argc > 1 ? atoi(argv[1]) : 100000;
+    char dir[1024], pats[4][PATH_MAX], **m;
+    const char *sfx[] = {"*", "*7.log", "f00001??.txt", "f[0-9]*[13579].log"};
+    arena_t a = {0};
+    glob_t gl;
+    double t, mine, theirs;
+    int count, gcount;
+
+    if (argc > 2)
+        snprintf(dir, sizeof(dir), "%s", argv[2]);
+    else
+        snprintf(dir, sizeof(dir), "%s/mpsh-glob", getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+    fill(dir, n);
+
+    printf("pattern,matches,mpsh_ms,glob3_ms\n");
+    for (int i = 0; i < 4; i++) {
+        snprintf(pats[i], sizeof(pats[i]), "%s/%s", dir, sfx[i]);
+        glob_reset();
+        t = now();
+        count = mpsh_glob(pats[i], &a, &m);
+        mine = now() - t;
+        arena_reset(&a);
+
+        t = now();
+        gcount = glob(pats[i], 0, NULL, &gl) == 0 ? gl.gl_pathc : 0;
+        theirs = now() - t;
+        globfree(&gl);
+        if (count != gcount)
+            fprintf(stderr, "%s: %d matches, glob(3) %d\n", sfx[i], count, gcount);
+        printf("%s,%d,%.2f,%.2f\n", sfx[i], count, mine, theirs);
+    }
+
+    // one line, two patterns: the directory is read once
+    glob_reset();
+    t = now();
+    count = mpsh_glob(pats[1], &a, &m);
+    count += mpsh_glob(pats[2], &a, &m);
+    mine = now() - t;
+    arena_reset(&a);
+    t = now();
+    glob(pats[1], 0, NULL, &gl);
+    glob(pats[2], GLOB_APPEND, NULL, &gl);
+    theirs = now() - t;
+    printf("%s %s,%d,%.2f,%.2f\n", sfx[1], sfx[2], count, mine, theirs);
+    globfree(&gl);
+    return 0;
+}
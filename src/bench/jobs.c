@@ -0,0 +1,59 @@
+/*
+ * jobs - microbenchmark of the job list
+ * adds N jobs, looks each up by PID and by JID, then deletes them,
+ * and prints the cost per operation as CSV
+ *
+ * @author Monthon Paul
+ * @version March 11, 2024
+ */
+#include "../mpsh.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* now - monotonic time in nanoseconds */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    int sizes[] = {10, 1000, 100000};
+    int rounds = argc > 1 ? atoi(argv[1]) : 20;
+
+    printf("jobs,add_ns,lookup_pid_ns,lookup_jid_ns,delete_ns\n");
+    for (int s = 0; s < sizeof(sizes) / sizeof(int); s++) {
+        int n = sizes[s];
+        double add = 0, bypid = 0, byjid = 0, del = 0, t;
+        volatile long sink = 0;
+
+        initjobs(&jobs);
+        for (int r = 0; r < rounds; r++) {
+            // scattered PIDs, like a busy host hands out
+            t = now();
+            for (int i = 0; i < n; i++)
+                addjob(&jobs, 1000 + i * 7919 % 4000037, BG, "bench &\n");
+            add += now() - t;
+
+            t = now();
+            for (int i = 0; i < n; i++)
+                sink += getjobpid(&jobs, 1000 + i * 7919 % 4000037)->jid;
+            bypid += now() - t;
+
+            t = now();
+            for (int i = 1; i <= n; i++)
+                sink += getjobjid(&jobs, i)->pid;
+            byjid += now() - t;
+
+            t = now();
+            for (int i = 0; i < n; i++)
+                deletejob(&jobs, 1000 + i * 7919 % 4000037);
+            del += now() - t;
+        }
+        double ops = (double)n * rounds;
+        printf("%d,%.1f,%.1f,%.1f,%.1f\n", n, add / ops, bypid / ops, byjid / ops, del / ops);
+    }
+    return 0;
+}
@@ -0,0 +1,29 @@
+#!/bin/sh
+# launch.sh - fork vs posix_spawn vs launch pool latency
+# runs N lines of a K-stage `/bin/true | /bin/true ...` pipeline through mpsh
+# with each launch mode and prints microseconds per line
+#
+# usage: bench/launch.sh [N]   (from src, after make)
+
+MPSH=${MPSH:-./mpsh}
+N=${1:-2000}
+TMP=${TMPDIR:-/tmp}/mpsh-launch.$$
+
+trap 'rm -f $TMP' EXIT
+
+printf "stages,mode,lines,usec_per_line\n"
+for k in 1 4 16; do
+    line=/bin/true
+    i=1
+    while [ $i -lt $k ]; do
+        line="$line | /bin/true"
+        i=$((i + 1))
+    done
+    yes "$line" | head -n "$N" > $TMP
+    for mode in fork spawn pool; do
+        start=$(date +%s%N)
+        MPSH_LAUNCH=$mode $MPSH < $TMP > /dev/null
+        end=$(date +%s%N)
+        printf "%d,%s,%d,%d\n" $k $mode $N $(((end - start) / 1000 / N))
+    done
+done
@@ -0,0 +1,85 @@
+/*
+ * parse - parser throughput
+ * generates a script of MB megabytes (pipelines, quotes, escapes,
+ * redirections, comments), then parses it whole as a script would
+ * be, line by line as at the prompt, and expands the tree it made
+ * again as a loop body would be; prints MB/s of each as CSV
+ *
+ * usage: bench/parse [MB]   (default 64)
+ *
+ * @author Monthon Paul
+ * @version March 11, 2024
+ */
+#include "../mpsh.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char *lines[] = {
+    "ls -la /usr/lib | grep -v '\\.so' | sort -k 5 -n | tail -n 20 > big.txt\n",
+    "echo \"hello   world\" 'it''s' a\\ b ; printf '%s\\n' \"$HOME\" >> log &\n",
+    "cat < in.txt | tr a-z A-Z | wc -c ; sleep 1 & # run it in the background\n",
+    "gcc -O2 -Wall -c mpsh.c -o mpsh.o 2>&1 | tee cc.log ; echo built\n",
+    "find . -name \"*.c\" | xargs grep -n 'TODO' | head\n",
+    "\n",
+};
+
+/* now - monotonic time in seconds */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    size_t size = (argc > 1 ? atoi(argv[1]) : 64) * 1048576UL, len = 0, nl = 0;
+    char *src = malloc(size + 128), *copy = malloc(size + 128), *p, *end;
+    arena_t tree = {0}, scratch = {0};
+    list_t *list;
+    cmd_t cmd;
+    double t, whole, byline, expand;
+    long words = 0;
+
+    srand(1);
+    while (len < size) {
+        const char *l = lines[rand() % (sizeof(lines) / sizeof(char *))];
+        len = stpcpy(src + len, l) - src;
+        nl++;
+    }
+
+    t = now();
+    if ((list = mpsh_parse(src, &tree)) == NULL)
+        return 1;
+    whole = now() - t;
+
+    // as at the prompt: one line at a time, the arena reset after each
+    memcpy(copy, src, len + 1);
+    t = now();
+    for (p = copy; *p; p = end + 1) {
+        end = strchr(p, '\n');
+        *end = '\0';
+        if (mpsh_parse(p, &scratch) == NULL)
+            return 1;
+        arena_reset(&scratch);
+    }
+    byline = now() - t;
+
+    // run the tree again: expand every command, as a loop body would
+    t = now();
+    for (pipeline_t *pl = list->head; pl; pl = pl->next) {
+        for (simple_t *s = pl->cmds; s; s = s->next) {
+            mpsh_expand(s, &scratch, &cmd);
+            words += cmd.argc;
+        }
+        arena_reset(&scratch);
+    }
+    expand = now() - t;
+
+    printf("mode,bytes,lines,pipelines,seconds,mb_per_s\n");
+    printf("script,%zu,%zu,%d,%.3f,%.1f\n", len, nl, list->npipes, whole, len / 1048576.0 / whole);
+    printf("lines,%zu,%zu,%d,%.3f,%.1f\n", len, nl, list->npipes, byline, len / 1048576.0 / byline);
+    printf("expand,%zu,%ld,%d,%.3f,%.1f\n", len, words, list->npipes, expand, len / 1048576.0 / expand);
+    return 0;
+}
@@ -0,0 +1,28 @@
+#!/bin/sh
+# pipes.sh - pipeline throughput against pipe capacity
+# pushes BYTES through `dd | cat | ... | wc -c` chains of K stages
+# with each pipesize setting and prints seconds and MB/s
+#
+# usage: bench/pipes.sh [BYTES]   (from src, after make; default 10 GB)
+
+MPSH=${MPSH:-./mpsh}
+BYTES=${1:-10000000000}
+MB=$((BYTES / 1048576))
+
+printf "stages,pipesize,bytes,seconds,mb_per_s\n"
+for k in 2 4 8 16; do
+    line="dd if=/dev/zero bs=1M count=$MB status=none"
+    i=2
+    while [ $i -lt $k ]; do
+        line="$line | cat"
+        i=$((i + 1))
+    done
+    line="$line | wc -c"
+    for size in default auto 1m "-p auto"; do
+        start=$(date +%s%N)
+        $MPSH -c "pipesize $size $line" > /dev/null
+        end=$(date +%s%N)
+        awk -v k=$k -v s="$size" -v b=$((MB * 1048576)) -v ns=$((end - start)) \
+            'BEGIN { printf "%d,%s,%d,%.3f,%.0f\n", k, s, b, ns / 1e9, b / 1048576 / (ns / 1e9) }'
+    done
+done
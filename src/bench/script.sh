@@ -0,0 +1,33 @@
+#!/bin/sh
+# script.sh - batch mode throughput against other shells
+# runs an N-line script of a builtin (`cd .`) and of an
+# external command (/bin/true) through mpsh, dash and bash
+#
+# usage: bench/script.sh [N] [M]   (from src, after make)
+#   N lines of builtins (default 1000000), M lines of /bin/true (default 5000)
+
+MPSH=${MPSH:-./mpsh}
+N=${1:-1000000}
+M=${2:-5000}
+TMP=${TMPDIR:-/tmp}/mpsh-script.$$
+
+trap 'rm -f $TMP' EXIT
+
+# run - time one shell on the script, print a CSV row
+run() {
+    start=$(date +%s%N)
+    "$1" $TMP > /dev/null
+    end=$(date +%s%N)
+    awk -v k="$2" -v sh="$1" -v n="$3" -v ns=$((end - start)) \
+        'BEGIN { printf "%s,%s,%d,%d,%.3f\n", k, sh, n, ns / 1e6, ns / 1e3 / n }'
+}
+
+printf "lines,shell,count,ms,usec_per_line\n"
+yes "cd ." | head -n "$N" > $TMP
+for sh in $MPSH dash bash; do
+    command -v $sh > /dev/null && run $sh builtin "$N"
+done
+yes /bin/true | head -n "$M" > $TMP
+for sh in $MPSH dash bash; do
+    command -v $sh > /dev/null && run $sh external "$M"
+done
@@ -0,0 +1,386 @@
+/*
+ * shell - the benchmark suite, mpsh against itself and other shells
+ * links the shell (mpsh.c built with MPSH_NO_MAIN) to time its own
+ * paths in process:
+ *   parse     mpsh_parse + mpsh_expand of synthetic lines, MB/s
+ *   launch    /bin/true through mpsh_launch, per launch mode, usec each
+ *   pipeline  dd | cat | wc -c through mpsh_piping, MB/s
+ *   storm     thousands of & jobs exiting at once: reap rate, and any
+ *             job the reaping lost (still listed once no child is left);
+ *             as a script, & jobs and a wait
+ * then runs the same work as scripts through mpsh, dash and bash
+ * (those installed) and times them whole. One row per case, shell
+ * and variant, as CSV or with -j as JSON
+ *
+ * usage: bench/shell [-j] [SCALE]   (from src, after make; SCALE
+ *        multiplies every count, default 1; $MPSH is the mpsh to run)
+ *
+ * @author Monthon Paul
+ * @version March 11, 2024
+ */
+#include "../mpsh.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define REPS 5 /* runs of each script, their spread gives the percentiles */
+
+typedef struct result_t { /* One row */
+    const char *bench, *shell, *variant, *unit;
+    int count;            /* launches, jobs, lines or MB per run */
+    double mean, p50, p90, p99;
+    int errors;           /* failed runs, or jobs lost by the storm */
+} result_t;
+
+static int json;       /* -j: JSON rather than CSV */
+static int nrows;      /* rows printed so far */
+static char tmp[PATH_MAX]; /* script file for the other shells */
+
+/* now - monotonic time in microseconds */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* dblcmp - qsort order of samples */
+static int dblcmp(const void *a, const void *b) {
+    double x = *(double *)a, y = *(double *)b;
+    return (x > y) - (x < y);
+}
+
+/* report - Sum up n samples into a row and print it */
+static void report(result_t *r, double *v, int n) {
+    double sum = 0;
+
+    qsort(v, n, sizeof(double), dblcmp);
+    for (int i = 0; i < n; i++)
+        sum += v[i];
+    r->mean = n ? sum / n : 0;
+    r->p50 = n ? v[(n - 1) / 2] : 0;
+    r->p90 = n ? v[(int)((n - 1) * 0.9)] : 0;
+    r->p99 = n ? v[(int)((n - 1) * 0.99)] : 0;
+    if (json)
+        printf("%s\n  {\"bench\": \"%s\", \"shell\": \"%s\", \"variant\": \"%s\", "
+               "\"count\": %d, \"unit\": \"%s\", \"mean\": %.2f, \"p50\": %.2f, "
+               "\"p90\": %.2f, \"p99\": %.2f, \"errors\": %d}",
+               nrows ? "," : "[", r->bench, r->shell, r->variant, r->count, r->unit, r->mean,
+               r->p50, r->p90, r->p99, r->errors);
+    else
+        printf("%s,%s,%s,%d,%s,%.2f,%.2f,%.2f,%.2f,%d\n", r->bench, r->shell, r->variant,
+               r->count, r->unit, r->mean, r->p50, r->p90, r->p99, r->errors);
+    fflush(stdout);
+    nrows++;
+}
+
+/* simple - A command of the shell, its stdin and stdout from in / out (-1: as they are) */
+static cmd_t simple(char **argv, fdact_t *acts, int in, const char *out) {
+    cmd_t cmd = {argv, 0};
+
+    while (argv[cmd.argc])
+        cmd.argc++;
+    cmd.acts = acts;
+    if (in != -1)
+        acts[cmd.nacts++] = (fdact_t){FD_DUP, STDIN_FILENO, in, 0, NULL, 0};
+    if (out)
+        acts[cmd.nacts++] = (fdact_t){FD_OPEN, STDOUT_FILENO, 0, O_WRONLY, (char *)out, 0};
+    return cmd;
+}
+
+/* run_shell - Run sh on the script file, or on -c text; time in usec, -1 if it failed */
+static double run_shell(const char *sh, const char *text) {
+    double t = now();
+    int status;
+    pid_t pid;
+
+    fflush(stdout);
+    if ((pid = fork()) == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        sigprocmask(SIG_UNBLOCK, &evsigs, NULL);
+        dup2(null, STDOUT_FILENO);
+        if (text)
+            execlp(sh, sh, "-c", text, (char *)NULL);
+        else
+            execlp(sh, sh, tmp, (char *)NULL);
+        _exit(127);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status))
+        return -1;
+    return now() - t;
+}
+
+/* label - A shell's name in the results, without its directory */
+static const char *label(const char *sh) {
+    return strrchr(sh, '/') ? strrchr(sh, '/') + 1 : sh;
+}
+
+/* shells - The shells to compare: $MPSH, and dash and bash if installed */
+static int shells(const char **sh) {
+    const char *other[] = {"dash", "bash"};
+    char path[PATH_MAX];
+    int n = 0;
+
+    sh[n++] = getenv("MPSH") ? getenv("MPSH") : "./mpsh";
+    for (int i = 0; i < 2; i++) {
+        snprintf(path, sizeof(path), "command -v %s > /dev/null", other[i]);
+        if (system(path) == 0)
+            sh[n++] = other[i];
+    }
+    return n;
+}
+
+/* script - Write n copies of line, then end, to the script file; return its size */
+static size_t script(const char *line, int n, const char *end) {
+    FILE *f = fopen(tmp, "w");
+    size_t len = strlen(line);
+
+    if (f == NULL) {
+        perror(tmp);
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < n; i++)
+        fputs(line, f);
+    fputs(end, f);
+    fclose(f);
+    return len * n + strlen(end);
+}
+
+/* Synthetic lines for parsing: quotes, escapes, comments, ;, builtins only */
+static const char *lines[] = {
+    "true 'it''s' \"hello   world\" a\\ b -n 42 --long=option ; true x y z\n",
+    "true /usr/lib/x86_64-linux-gnu \"quoted \\\"inner\\\" text\" 'single' # a comment\n",
+    "true one two three four five six seven eight nine ten\n",
+};
+
+/* bench_parse - Parse and expand lines as the prompt would, then as scripts of other shells */
+static void bench_parse(int scale) {
+    int n = 100000 * scale, nl = sizeof(lines) / sizeof(char *);
+    const char *sh[3];
+    double v[REPS];
+    arena_t a = {0};
+    size_t bytes = 0;
+    cmd_t cmd;
+    char buf[256];
+
+    for (int r = 0; r < REPS; r++) {
+        double t = now();
+        bytes = 0;
+        for (int i = 0; i < n; i++) {
+            list_t *list;
+            strcpy(buf, lines[i % nl]);
+            bytes += strlen(buf);
+            if ((list = mpsh_parse(buf, &a)) == NULL)
+                exit(EXIT_FAILURE);
+            for (pipeline_t *pl = list->head; pl; pl = pl->next)
+                for (simple_t *s = pl->cmds; s; s = s->next)
+                    mpsh_expand(s, &a, &cmd);
+            arena_reset(&a);
+        }
+        v[r] = bytes / ((now() - t) / 1e6) / 1048576;
+    }
+    report(&(result_t){"parse", "mpsh", "in-process", "MB/s", n}, v, REPS);
+    arena_free(&a);
+
+    // the others can't parse without running: a script of builtins
+    FILE *f = fopen(tmp, "w");
+    for (int i = 0; f && i < n; i++)
+        fputs(lines[i % nl], f);
+    if (f)
+        fclose(f);
+    for (int s = 0, ns = shells(sh); s < ns; s++) {
+        result_t res = {"parse", label(sh[s]), "script", "MB/s", n};
+        int k = 0;
+        for (int r = 0; r < REPS; r++) {
+            double t = run_shell(sh[s], NULL);
+            if (t < 0)
+                res.errors++;
+            else
+                v[k++] = bytes / (t / 1e6) / 1048576;
+        }
+        report(&res, v, k);
+    }
+}
+
+/* bench_launch - Latency of each /bin/true, in process by launch mode, then per other shell */
+static void bench_launch(int scale) {
+    int n = 2000 * scale, m = 200 * scale;
+    char *argv[] = {"/bin/true", NULL}, *modes[] = {"fork", "spawn", "pool"};
+    double *v = malloc(n * sizeof(double));
+    const char *sh[3];
+    fdact_t acts[2];
+
+    if (v == NULL) {
+        fprintf(stderr, "mpsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int mode = 0; mode < 3; mode++) {
+        result_t res = {"launch", "mpsh", modes[mode], "usec", n};
+        cmd_t cmd = simple(argv, acts, -1, NULL);
+        launch_mode = mode;
+        mpsh_launch(&cmd, evsigs);  // the pool helper starts on first use
+        for (int i = 0; i < n; i++) {
+            double t = now();
+            mpsh_launch(&cmd, evsigs);
+            v[i] = now() - t;
+            res.errors += (last_status != 0);
+        }
+        report(&res, v, n);
+    }
+    launch_mode = LAUNCH_FORK;
+
+    script("/bin/true\n", m, "");
+    for (int s = 0, ns = shells(sh); s < ns; s++) {
+        result_t res = {"launch", label(sh[s]), "script", "usec", m};
+        int k = 0;
+        for (int r = 0; r < REPS; r++) {
+            double t = run_shell(sh[s], NULL);
+            if (t < 0)
+                res.errors++;
+            else
+                v[k++] = t / m;
+        }
+        report(&res, v, k);
+    }
+    free(v);
+}
+
+/* bench_pipeline - Bytes through dd | cat | wc -c, in process, then through other shells */
+static void bench_pipeline(int scale) {
+    int mb = 256 * scale;
+    char count[32], text[128];
+    char *dd[] = {"dd", "if=/dev/zero", "bs=1M", count, "status=none", NULL};
+    char *cat[] = {"cat", NULL}, *wc[] = {"wc", "-c", NULL};
+    fdact_t acts[3][2];
+    const char *sh[3];
+    double v[REPS];
+
+    snprintf(count, sizeof(count), "count=%d", mb);
+    cmd_t cmds[3] = {simple(dd, acts[0], -1, NULL), simple(cat, acts[1], -1, NULL),
+                     simple(wc, acts[2], -1, "/dev/null")};
+    cmds[0].piped = cmds[1].piped = 1;
+    result_t res = {"pipeline", "mpsh", "in-process", "MB/s", mb};
+    for (int r = 0; r < REPS; r++) {
+        double t = now();
+        mpsh_piping(cmds, 3, &pipecfg, evsigs);
+        v[r] = mb / ((now() - t) / 1e6);
+        res.errors += (last_status != 0);
+    }
+    report(&res, v, REPS);
+
+    snprintf(text, sizeof(text), "dd if=/dev/zero bs=1M count=%d status=none | cat | wc -c", mb);
+    for (int s = 0, ns = shells(sh); s < ns; s++) {
+        result_t res = {"pipeline", label(sh[s]), "-c", "MB/s", mb};
+        int k = 0;
+        for (int r = 0; r < REPS; r++) {
+            double t = run_shell(sh[s], text);
+            if (t < 0)
+                res.errors++;
+            else
+                v[k++] = mb / (t / 1e6);
+        }
+        report(&res, v, k);
+    }
+}
+
+/*
+ * bench_storm - Start n & jobs all blocked reading one pipe, close it
+ * so they exit at once, and reap them through the event loop
+ */
+static void bench_storm(int scale) {
+    int n = 2000 * scale, fds[2], saved, null;
+    char *argv[] = {"cat", NULL};
+    const char *sh[3];
+    double v[REPS];
+    result_t res = {"storm", "mpsh", "in-process", "jobs/s", n};
+
+    for (int r = 0; r < REPS; r++) {
+        siginfo_t si;
+        double t;
+
+        if (pipe2(fds, O_CLOEXEC) == -1) {
+            perror("pipe");
+            exit(EXIT_FAILURE);
+        }
+        // the [1] (pid) line of every job goes nowhere
+        fflush(stdout);
+        saved = dup(STDOUT_FILENO);
+        null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        dup2(null, STDOUT_FILENO);
+        close(null);
+        for (int i = 0; i < n; i++) {
+            fdact_t acts[2];
+            cmd_t cmd = simple(argv, acts, fds[0], "/dev/null");
+            cmd.bg = 1;
+            mpsh_launch(&cmd, evsigs);
+        }
+        fflush(stdout);
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+        close(fds[0]);
+
+        t = now();
+        close(fds[1]);  // go
+        while (jobs.njobs > 0) {
+            // every child reaped with jobs still listed: their updates were lost
+            si.si_pid = 0;
+            if (waitid(P_ALL, 0, &si, WEXITED | WNOHANG | WNOWAIT) == -1 && errno == ECHILD)
+                break;
+            ev_signals();
+        }
+        v[r] = n / ((now() - t) / 1e6);
+        res.errors += jobs.njobs;
+        if (jobs.njobs)
+            initjobs(&jobs);
+    }
+    report(&res, v, REPS);
+
+    // as scripts: n & jobs and a wait for them, starting them included
+    script("/bin/true &\n", n, "wait\n");
+    for (int s = 0, ns = shells(sh); s < ns; s++) {
+        result_t res = {"storm", label(sh[s]), "script", "jobs/s", n};
+        int k = 0;
+        for (int r = 0; r < REPS; r++) {
+            double t = run_shell(sh[s], NULL);
+            if (t < 0)
+                res.errors++;
+            else
+                v[k++] = n / (t / 1e6);
+        }
+        report(&res, v, k);
+    }
+}
+
+int main(int argc, char **argv) {
+    int scale = 1;
+
+    // the launch pool helper is this binary too
+    if (argc == 3 && !strcmp(argv[1], "--pool"))
+        return pool_helper(atoi(argv[2]));
+    if (argc > 1 && !strcmp(argv[1], "-j")) {
+        json = 1;
+        argv++;
+        argc--;
+    }
+    if (argc > 1)
+        scale = atoi(argv[1]) > 0 ? atoi(argv[1]) : 1;
+    snprintf(tmp, sizeof(tmp), "%s/mpsh-bench.%d", getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp",
+             getpid());
+
+    // as mpsh sets itself up
+    ev_init();
+    Signal(SIGTTOU, SIG_IGN);
+    builtin_init();
+    initjobs(&jobs);
+
+    if (!json)
+        printf("bench,shell,variant,count,unit,mean,p50,p90,p99,errors\n");
+    bench_parse(scale);
+    bench_storm(scale);
+    bench_pipeline(scale);
+    bench_launch(scale);
+    if (json)
+        printf("\n]\n");
+    unlink(tmp);
+    return 0;
+}
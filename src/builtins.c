@@ -0,0 +1,433 @@
+/*
+ * builtins - utilities run inside the shell
+ * echo, printf, true, false, test / [ and pwd
+ * are common enough in scripts that a fork + exec
+ * for each of them costs more than the work they do
+ *
+ * @author Monthon Paul
+ * @version March 11, 2024
+ */
+#include "mpsh.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/**
+ * @brief Write a string, expanding backslash escapes (echo -e, printf %b).
+ * @param s the string
+ * @return 0, or 1 if a \c asked to stop all output
+ */
+static int put_escaped(const char *s) {
+    for (; *s; s++) {
+        if (*s != '\\' || !s[1]) {
+            putchar(*s);
+            continue;
+        }
+        switch (*++s) {
+            case 'a': putchar('\a'); break;
+            case 'b': putchar('\b'); break;
+            case 'c': return 1;
+            case 'e': putchar('\033'); break;
+            case 'f': putchar('\f'); break;
+            case 'n': putchar('\n'); break;
+            case 'r': putchar('\r'); break;
+            case 't': putchar('\t'); break;
+            case 'v': putchar('\v'); break;
+            case '\\': putchar('\\'); break;
+            case '0': {
+                int c = 0;
+                for (int i = 0; i < 3 && s[1] >= '0' && s[1] <= '7'; i++)
+                    c = c * 8 + (*++s - '0');
+                putchar(c);
+                break;
+            }
+            default:
+                putchar('\\');
+                putchar(*s);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief builtin echo [-neE] [args ...]
+ * @param ctx arguments (including program) and context.
+ * @return Always returns 1, to continue execution.
+ */
+int mpsh_echo(builtin_ctx_t *ctx) {
+    char **args = ctx->argv;
+    int newline = 1, escapes = 0, i = 1;
+
+    // options only while every letter is one of n, e, E
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        if (strspn(args[i] + 1, "neE") != strlen(args[i] + 1))
+            break;
+        for (char *o = args[i] + 1; *o; o++) {
+            if (*o == 'n')
+                newline = 0;
+            else
+                escapes = (*o == 'e');
+        }
+    }
+    for (int first = i; args[i] != NULL; i++) {
+        if (i > first)
+            putchar(' ');
+        if (escapes ? put_escaped(args[i]) : (fputs(args[i], stdout), 0))
+            return 1;
+    }
+    if (newline)
+        putchar('\n');
+    return 1;
+}
+
+/**
+ * @brief Numeric printf argument: a number, or 'c for a character code.
+ */
+static long long printf_num(const char *s) {
+    char *end;
+    long long n;
+
+    if (!s)
+        return 0;
+    if (*s == '\'' || *s == '"')
+        return (unsigned char)s[1];
+    errno = 0;
+    n = strtoll(s, &end, 0);
+    if (*end || errno) {
+        fprintf(stderr, "printf: %s: invalid number\n", s);
+        last_status = 1;
+    }
+    return n;
+}
+
+/**
+ * @brief builtin printf format [args ...]
+ * The format is reused as long as arguments are left.
+ * @param ctx arguments (including program) and context.
+ * @return Always returns 1, to continue execution.
+ */
+int mpsh_printf(builtin_ctx_t *ctx) {
+    char **args = ctx->argv;
+    char spec[64], *fmt = args[1], **arg;
+
+    if (!fmt) {
+        printf("usage: printf format [arguments]\n");
+        last_status = 1;
+        return 1;
+    }
+    arg = &args[2];
+    do {
+        char **start = arg;
+        for (char *p = fmt; *p; p++) {
+            if (*p == '\\') {
+                char esc[6] = {'\\', 0};
+                // a single escape sequence, \0NNN takes up to 3 digits
+                int len = 1;
+                esc[len++] = *++p;
+                while (esc[1] == '0' && len < 5 && p[1] >= '0' && p[1] <= '7')
+                    esc[len++] = *++p;
+                esc[len] = '\0';
+                if (!*p)
+                    break;
+                if (put_escaped(esc))
+                    return 1;
+                continue;
+            }
+            if (*p != '%') {
+                putchar(*p);
+                continue;
+            }
+            if (p[1] == '%') {
+                putchar(*++p);
+                continue;
+            }
+
+            // copy flags, width and precision, then the conversion
+            size_t n = strspn(p + 1, "-+ #0123456789.");
+            if (n + 4 > sizeof(spec) || !p[n + 1]) {
+                fputs(p, stdout);
+                break;
+            }
+            memcpy(spec, p, n + 1);
+            char conv = p[n + 1];
+            p += n + 1;
+            char *a = *arg ? *arg++ : NULL;
+            switch (conv) {
+                case 'd':
+                case 'i':
+                    strcpy(spec + n + 1, "lld");
+                    printf(spec, printf_num(a));
+                    break;
+                case 'o':
+                case 'u':
+                case 'x':
+                case 'X':
+                    spec[n + 1] = 'l';
+                    spec[n + 2] = 'l';
+                    spec[n + 3] = conv;
+                    spec[n + 4] = '\0';
+                    printf(spec, (unsigned long long)printf_num(a));
+                    break;
+                case 'c': {
+                    // as a one-character %s, so a missing argument prints nothing
+                    char c[2] = {a ? *a : '\0', '\0'};
+                    strcpy(spec + n + 1, "s");
+                    printf(spec, c);
+                    break;
+                }
+                case 's':
+                    strcpy(spec + n + 1, "s");
+                    printf(spec, a ? a : "");
+                    break;
+                case 'b':
+                    if (a && put_escaped(a))
+                        return 1;
+                    break;
+                default:
+                    fprintf(stderr, "printf: %%%c: invalid directive\n", conv);
+                    last_status = 1;
+                    return 1;
+            }
+        }
+        if (arg == start)
+            break;  // format used no arguments, don't loop forever
+    } while (*arg);
+    return 1;
+}
+
+/**
+ * @brief builtin true, succeed.
+ * @param ctx arguments (including program) and context.
+ * @return Always returns 1, to continue execution.
+ */
+int mpsh_true(builtin_ctx_t *ctx) {
+    last_status = 0;
+    return 1;
+}
+
+/**
+ * @brief builtin false, fail.
+ * @param ctx arguments (including program) and context.
+ * @return Always returns 1, to continue execution.
+ */
+int mpsh_false(builtin_ctx_t *ctx) {
+    last_status = 1;
+    return 1;
+}
+
+/**
+ * @brief builtin pwd, print the working directory.
+ * @param ctx arguments (including program) and context.
+ * @return Always returns 1, to continue execution.
+ */
+int mpsh_pwd(builtin_ctx_t *ctx) {
+    char buf[PATH_MAX];
+
+    if (getcwd(buf, sizeof(buf)) == NULL) {
+        perror("pwd");
+        last_status = 1;
+    } else {
+        puts(buf);
+    }
+    return 1;
+}
+
+/*
+ * test expression parser, recursive descent over the arguments:
+ *   expr    := and ( -o and )*
+ *   and     := not ( -a not )*
+ *   not     := ! not | primary
+ *   primary := ( expr ) | unary-op word | word binary-op word | word
+ */
+typedef struct test_t {
+    char **argv;
+    int argc, pos;
+    int err;
+} test_t;
+
+static int test_expr(test_t *t);
+
+/* test_binary - Is op a binary operator of test */
+static int test_binary(const char *op) {
+    static char *ops[] = {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt",
+                          "-le", "-gt", "-ge", "-nt", "-ot", "-ef"};
+    for (int i = 0; i < sizeof(ops) / sizeof(char *); i++)
+        if (!strcmp(op, ops[i]))
+            return 1;
+    return 0;
+}
+
+/* test_int - Integer operand of test */
+static long long test_int(test_t *t, const char *s) {
+    char *end;
+    long long n = strtoll(s, &end, 10);
+    if (!*s || *end) {
+        fprintf(stderr, "test: %s: integer expression expected\n", s);
+        t->err = 1;
+    }
+    return n;
+}
+
+/* test_unary - Evaluate a unary primary, op is like "-f" */
+static int test_unary(test_t *t, char op, const char *arg) {
+    struct stat st;
+
+    switch (op) {
+        case 'n': return *arg != '\0';
+        case 'z': return *arg == '\0';
+        case 't': return isatty(atoi(arg));
+        case 'L':
+        case 'h': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+        case 'r': return access(arg, R_OK) == 0;
+        case 'w': return access(arg, W_OK) == 0;
+        case 'x': return access(arg, X_OK) == 0;
+    }
+    if (stat(arg, &st) == -1)
+        return 0;
+    switch (op) {
+        case 'e': return 1;
+        case 'f': return S_ISREG(st.st_mode);
+        case 'd': return S_ISDIR(st.st_mode);
+        case 'b': return S_ISBLK(st.st_mode);
+        case 'c': return S_ISCHR(st.st_mode);
+        case 'p': return S_ISFIFO(st.st_mode);
+        case 'S': return S_ISSOCK(st.st_mode);
+        case 's': return st.st_size > 0;
+        case 'u': return (st.st_mode & S_ISUID) != 0;
+        case 'g': return (st.st_mode & S_ISGID) != 0;
+        case 'k': return (st.st_mode & S_ISVTX) != 0;
+    }
+    fprintf(stderr, "test: -%c: unary operator expected\n", op);
+    t->err = 1;
+    return 0;
+}
+
+/* test_mtime - Compare modification times, to the nanosecond */
+static int test_mtime(struct stat *a, struct stat *b) {
+    if (a->st_mtim.tv_sec != b->st_mtim.tv_sec)
+        return a->st_mtim.tv_sec < b->st_mtim.tv_sec ? -1 : 1;
+    return (a->st_mtim.tv_nsec > b->st_mtim.tv_nsec) - (a->st_mtim.tv_nsec < b->st_mtim.tv_nsec);
+}
+
+/* test_compare - Evaluate a binary primary */
+static int test_compare(test_t *t, const char *a, const char *op, const char *b) {
+    struct stat sa, sb;
+
+    if (!strcmp(op, "=") || !strcmp(op, "=="))
+        return !strcmp(a, b);
+    if (!strcmp(op, "!="))
+        return strcmp(a, b) != 0;
+    if (!strcmp(op, "<"))
+        return strcmp(a, b) < 0;
+    if (!strcmp(op, ">"))
+        return strcmp(a, b) > 0;
+    if (op[1] == 'n' || op[1] == 'o' || (op[1] == 'e' && op[2] == 'f')) {
+        int ra = stat(a, &sa), rb = stat(b, &sb);
+        if (op[1] == 'e')
+            return !ra && !rb && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+        if (op[1] == 'n')
+            return !ra && (rb || test_mtime(&sa, &sb) > 0);
+        return !rb && (ra || test_mtime(&sa, &sb) < 0);
+    }
+
+    long long x = test_int(t, a), y = test_int(t, b);
+    if (!strcmp(op, "-eq")) return x == y;
+    if (!strcmp(op, "-ne")) return x != y;
+    if (!strcmp(op, "-lt")) return x < y;
+    if (!strcmp(op, "-le")) return x <= y;
+    if (!strcmp(op, "-gt")) return x > y;
+    return x >= y;  // -ge
+}
+
+static int test_primary(test_t *t) {
+    char **a = t->argv + t->pos;
+    int left = t->argc - t->pos;
+
+    if (left <= 0) {
+        fprintf(stderr, "test: argument expected\n");
+        t->err = 1;
+        return 0;
+    }
+    if (left >= 3 && test_binary(a[1])) {
+        t->pos += 3;
+        return test_compare(t, a[0], a[1], a[2]);
+    }
+    if (!strcmp(a[0], "(") && left >= 2) {
+        t->pos++;
+        int r = test_expr(t);
+        if (t->pos >= t->argc || strcmp(t->argv[t->pos], ")")) {
+            fprintf(stderr, "test: missing `)'\n");
+            t->err = 1;
+        }
+        t->pos++;
+        return r;
+    }
+    if (a[0][0] == '-' && a[0][1] && !a[0][2] && left >= 2) {
+        t->pos += 2;
+        return test_unary(t, a[0][1], a[1]);
+    }
+    t->pos++;
+    return a[0][0] != '\0';
+}
+
+static int test_not(test_t *t) {
+    if (t->pos < t->argc - 1 && !strcmp(t->argv[t->pos], "!")) {
+        t->pos++;
+        return !test_not(t);
+    }
+    return test_primary(t);
+}
+
+static int test_and(test_t *t) {
+    int r = test_not(t);
+    while (t->pos < t->argc && !strcmp(t->argv[t->pos], "-a")) {
+        t->pos++;
+        r = test_not(t) && r;
+    }
+    return r;
+}
+
+static int test_expr(test_t *t) {
+    int r = test_and(t);
+    while (t->pos < t->argc && !strcmp(t->argv[t->pos], "-o")) {
+        t->pos++;
+        r = test_and(t) || r;
+    }
+    return r;
+}
+
+/**
+ * @brief builtin test expr, or [ expr ]
+ * Status 0 if the expression is true, 1 if false, 2 on error.
+ * @param ctx arguments (including program) and context.
+ * @return Always returns 1, to continue execution.
+ */
+int mpsh_test(builtin_ctx_t *ctx) {
+    char **args = ctx->argv;
+    test_t t = {.argv = args + 1};
+
+    while (t.argv[t.argc])
+        t.argc++;
+    if (!strcmp(*args, "[")) {
+        if (!t.argc || strcmp(t.argv[t.argc - 1], "]")) {
+            fprintf(stderr, "[: missing `]'\n");
+            last_status = 2;
+            return 1;
+        }
+        t.argc--;
+    }
+    if (!t.argc) {
+        last_status = 1;  // no expression is false
+        return 1;
+    }
+
+    int r = test_expr(&t);
+    if (!t.err && t.pos < t.argc) {
+        fprintf(stderr, "test: %s: unexpected argument\n", t.argv[t.pos]);
+        t.err = 1;
+    }
+    last_status = t.err ? 2 : !r;
+    return 1;
+}
@@ -0,0 +1,511 @@
+/*
+ * cache - replay the output of commands run before on the same inputs
+ * `cached cmd args < in > out` keys the command by its words, the
+ * program it resolves to, a few environment variables, the directory,
+ * and the files it names and reads on stdin (their inode and mtime, or
+ * with -c their content). A hit writes the stored stdout and sets the
+ * stored status without starting a process; a miss runs the command
+ * with its stdout going through a tee process into the store. The store
+ * in ~/.cache/mpsh is kept under $MPSH_CACHE_MB, oldest used first out
+ *
+ * @author Monthon Paul
+ * @version March 11, 2024
+ */
+#include "mpsh.h"
+
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#define CACHE_MAGIC "mpshc01"
+#define CACHE_ENV "LANG LC_ALL LC_CTYPE LC_COLLATE LC_NUMERIC TZ" /* always in the key */
+
+typedef struct cache_hdr_t { /* Start of a store entry, stdout follows */
+    char magic[8];
+    int status;   /* exit status of the command */
+    int complete; /* the tee saw all of stdout */
+} cache_hdr_t;
+
+typedef struct cache_key_t { /* Two independent 64-bit hashes of the inputs */
+    uint64_t a, b;
+} cache_key_t;
+
+typedef struct cache_stats_t {
+    long long hits, misses, stores, evictions;
+} cache_stats_t;
+
+static char cachedir[PATH_MAX]; /* the store, empty until made */
+static cache_stats_t session;   /* this shell's */
+
+/* cache_mix - Add n bytes to the key */
+static void cache_mix(cache_key_t *k, const void *p, size_t n) {
+    const unsigned char *s = p;
+    for (size_t i = 0; i < n; i++) {
+        k->a = (k->a ^ s[i]) * 0x100000001b3ull;                         // FNV-1a
+        k->b = ((k->b << 5 | k->b >> 59) ^ s[i]) * 0x9e3779b97f4a7c15ull;  // rotate-multiply
+    }
+}
+
+/* cache_str - Add a string, with its end, to the key */
+static void cache_str(cache_key_t *k, const char *s) {
+    cache_mix(k, s, strlen(s) + 1);
+}
+
+/* cache_file - Add a regular file: what it is and when it changed, or what it holds */
+static void cache_file(cache_key_t *k, int fd, struct stat *st, int content) {
+    char buf[65536];
+    ssize_t n;
+    off_t off = 0;
+
+    if (!content) {
+        long long id[] = {st->st_dev, st->st_ino, st->st_size, st->st_mtim.tv_sec,
+                          st->st_mtim.tv_nsec};
+        cache_mix(k, id, sizeof(id));
+        return;
+    }
+    // pread, a stdin file stays where the command will start reading it
+    while ((n = pread(fd, buf, sizeof(buf), off)) > 0) {
+        cache_mix(k, buf, n);
+        off += n;
+    }
+    cache_mix(k, &off, sizeof(off));
+}
+
+/* cache_path - Add a word naming a regular file, by cache_file */
+static void cache_path(cache_key_t *k, const char *path, int content) {
+    struct stat st;
+    int fd;
+
+    if (stat(path, &st) == -1 || !S_ISREG(st.st_mode))
+        return;
+    cache_str(k, path);
+    if (!content) {
+        cache_file(k, -1, &st, 0);
+    } else if ((fd = open(path, O_RDONLY | O_CLOEXEC)) != -1) {
+        cache_file(k, fd, &st, 1);
+        close(fd);
+    }
+}
+
+/* cache_env - Add an environment variable, set or not */
+static void cache_env(cache_key_t *k, const char *name, size_t len) {
+    char var[256];
+    char *v;
+
+    if (len == 0 || len >= sizeof(var))
+        return;
+    memcpy(var, name, len);
+    var[len] = '\0';
+    cache_str(k, var);
+    cache_str(k, (v = getenv(var)) ? v : "\1unset");
+}
+
+/* cache_stdin - Whether the key can cover stdin: a regular file, or /dev/null */
+static int cache_stdin(void) {
+    struct stat st, null;
+
+    if (fstat(STDIN_FILENO, &st) == -1)
+        return 1;  // closed, nothing to read
+    if (S_ISREG(st.st_mode))
+        return 1;
+    return S_ISCHR(st.st_mode) && stat("/dev/null", &null) == 0 && st.st_rdev == null.st_rdev;
+}
+
+/**
+ * @brief The key of a command, its redirections already done in the shell.
+ * @param cmd the command
+ * @param path the program it runs
+ * @param content hash the files it names by content, not inode and mtime
+ * @param key receives the key, as 32 hex digits
+ */
+static void cache_key(cmd_t *cmd, char *path, int content, char key[33]) {
+    cache_key_t k = {0xcbf29ce484222325ull, 0x243f6a8885a308d3ull};
+    char cwd[PATH_MAX], *extra = getenv("MPSH_CACHE_ENV");
+    const char *lists[] = {CACHE_ENV, extra ? extra : ""};
+    struct stat st;
+
+    cache_str(&k, CACHE_MAGIC);
+    cache_str(&k, getcwd(cwd, sizeof(cwd)) ? cwd : "");
+    // the program, rebuilt or upgraded it's another
+    cache_str(&k, path);
+    if (stat(path, &st) == 0)
+        cache_file(&k, -1, &st, 0);
+    for (int i = 0; i < cmd->argc; i++)
+        cache_str(&k, cmd->argv[i]);
+    for (int i = 1; i < cmd->argc; i++)
+        cache_path(&k, cmd->argv[i], content);
+    // where stdout goes makes no difference, the other redirections do
+    for (int i = 0; i < cmd->nacts; i++) {
+        fdact_t *a = &cmd->acts[i];
+        if (a->fd == STDOUT_FILENO)
+            continue;
+        cache_mix(&k, &a->op, sizeof(a->op));
+        cache_mix(&k, &a->fd, sizeof(a->fd));
+        cache_mix(&k, &a->src, sizeof(a->src));
+        cache_str(&k, a->path ? a->path : "");
+    }
+    // stdin, when it is a file (< in): the command may read it (cache_stdin)
+    if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode))
+        cache_file(&k, STDIN_FILENO, &st, content);
+    for (int l = 0; l < 2; l++) {
+        for (const char *s = lists[l]; *s; s += strspn(s, " :")) {
+            size_t len = strcspn(s, " :");
+            cache_env(&k, s, len);
+            s += len;
+        }
+    }
+    snprintf(key, 33, "%016llx%016llx", (unsigned long long)k.a, (unsigned long long)k.b);
+}
+
+/* cache_init - Make the store's directory, once; -1 if it can't be */
+static int cache_init(void) {
+    char *dir = getenv("MPSH_CACHE_DIR"), *base;
+
+    if (*cachedir)
+        return 0;
+    if (dir) {
+        snprintf(cachedir, sizeof(cachedir), "%s", dir);
+    } else if ((base = getenv("XDG_CACHE_HOME")) && *base) {
+        snprintf(cachedir, sizeof(cachedir), "%s/mpsh", base);
+    } else if ((base = getenv("HOME"))) {
+        snprintf(cachedir, sizeof(cachedir), "%s/.cache", base);
+        mkdir(cachedir, 0755);
+        strncat(cachedir, "/mpsh", sizeof(cachedir) - strlen(cachedir) - 1);
+    } else {
+        return -1;
+    }
+    if (mkdir(cachedir, 0700) == -1 && errno != EEXIST) {
+        fprintf(stderr, "mpsh: cached: %s: %s\n", cachedir, strerror(errno));
+        *cachedir = '\0';
+        return -1;
+    }
+    return 0;
+}
+
+/* cache_count - Add to the store's totals, and to the session's */
+static void cache_count(int hits, int misses, int stores, int evictions, cache_stats_t *total) {
+    char path[PATH_MAX + 16], buf[128];
+    cache_stats_t t = {0};
+    ssize_t n;
+    int fd;
+
+    session.hits += hits;
+    session.misses += misses;
+    session.stores += stores;
+    session.evictions += evictions;
+    snprintf(path, sizeof(path), "%s/stats", cachedir);
+    if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1)
+        return;
+    // other shells use the same store
+    flock(fd, LOCK_EX);
+    if ((n = pread(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+        buf[n] = '\0';
+        sscanf(buf, "%lld %lld %lld %lld", &t.hits, &t.misses, &t.stores, &t.evictions);
+    }
+    t.hits += hits;
+    t.misses += misses;
+    t.stores += stores;
+    t.evictions += evictions;
+    n = snprintf(buf, sizeof(buf), "%lld %lld %lld %lld\n", t.hits, t.misses, t.stores, t.evictions);
+    if (pwrite(fd, buf, n, 0) == n)
+        ftruncate(fd, n);
+    close(fd);
+    if (total)
+        *total = t;
+}
+
+typedef struct cache_ent_t { /* An entry, as the eviction sees it */
+    struct timespec used;
+    off_t size;
+    char name[40];
+} cache_ent_t;
+
+/* cache_older - qsort order, least recently used first */
+static int cache_older(const void *x, const void *y) {
+    const cache_ent_t *a = x, *b = y;
+    if (a->used.tv_sec != b->used.tv_sec)
+        return a->used.tv_sec < b->used.tv_sec ? -1 : 1;
+    return (a->used.tv_nsec > b->used.tv_nsec) - (a->used.tv_nsec < b->used.tv_nsec);
+}
+
+/**
+ * @brief Walk the store: its size, and with evict, remove the least
+ * recently used entries until it is 90% of $MPSH_CACHE_MB (256 by default).
+ * @param evict remove entries if it is over
+ * @param nents receives the number of entries, if not NULL
+ * @return the size of the store in bytes, after any eviction
+ */
+static long long cache_walk(int evict, int *nents) {
+    char *mb = getenv("MPSH_CACHE_MB");
+    long long max = (mb && atoll(mb) > 0 ? atoll(mb) : 256) << 20, total = 0;
+    cache_ent_t *ents = NULL;
+    int n = 0, cap = 0, gone = 0;
+    struct dirent *d;
+    struct stat st;
+    DIR *dir;
+
+    if ((dir = opendir(cachedir)) == NULL)
+        return 0;
+    while ((d = readdir(dir)) != NULL) {
+        if (strlen(d->d_name) != 32 || fstatat(dirfd(dir), d->d_name, &st, 0) == -1)
+            continue;
+        if (n == cap && (ents = realloc(ents, (cap = cap ? 2 * cap : 64) * sizeof(cache_ent_t))) == NULL) {
+            fprintf(stderr, "mpsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        ents[n].used = st.st_mtim;  // a hit touches it
+        ents[n].size = st.st_size;
+        strcpy(ents[n++].name, d->d_name);
+        total += st.st_size;
+    }
+    if (evict && total > max) {
+        qsort(ents, n, sizeof(cache_ent_t), cache_older);
+        for (int i = 0; i < n && total > max / 10 * 9; i++) {
+            if (unlinkat(dirfd(dir), ents[i].name, 0) == 0) {
+                total -= ents[i].size;
+                gone++;
+            }
+        }
+        cache_count(0, 0, 0, gone, NULL);
+    }
+    closedir(dir);
+    free(ents);
+    if (nents)
+        *nents = n - gone;
+    return total;
+}
+
+/* cache_write - Write all of buf; -1 on error */
+static int cache_write(int fd, const char *buf, ssize_t n) {
+    for (ssize_t w; n > 0; buf += w, n -= w) {
+        if ((w = write(fd, buf, n)) == -1 && errno != EINTR)
+            return -1;
+        w = w < 0 ? 0 : w;
+    }
+    return 0;
+}
+
+/* cache_replay - Write a stored stdout to fd 1; its exit status, or 128+SIGPIPE */
+static int cache_replay(int fd, cache_hdr_t *hdr) {
+    static char buf[65536];
+    handler_t *pipe_handler = Signal(SIGPIPE, SIG_IGN);  // EPIPE instead
+    int status = hdr->status;
+    ssize_t n;
+
+    fflush(stdout);
+    while ((n = sendfile(STDOUT_FILENO, fd, NULL, MPSH_COPY_CHUNK)) > 0) {
+    }
+    // e.g. an O_APPEND file, which sendfile won't write to
+    if (n == -1 && errno == EINVAL) {
+        while ((n = read(fd, buf, sizeof(buf))) > 0 && cache_write(STDOUT_FILENO, buf, n) == 0) {
+        }
+    }
+    if (n == -1 && errno == EPIPE)
+        status = 128 + SIGPIPE;
+    else if (n == -1)
+        perror("mpsh: cached");
+    Signal(SIGPIPE, pipe_handler);
+    return status;
+}
+
+/* cache_tee - In the tee process: copy the command's stdout to dst and the entry */
+static void cache_tee(int in, int dst, int ent) {
+    static char buf[65536];
+    cache_hdr_t hdr;
+    ssize_t n;
+
+    while ((n = read(in, buf, sizeof(buf))) != 0) {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 || cache_write(dst, buf, n) == -1 || cache_write(ent, buf, n) == -1)
+            _exit(EXIT_FAILURE);  // a partial output is not kept
+    }
+    if (pread(ent, &hdr, sizeof(hdr), 0) == sizeof(hdr)) {
+        hdr.complete = 1;
+        if (pwrite(ent, &hdr, sizeof(hdr), 0) == sizeof(hdr))
+            _exit(EXIT_SUCCESS);
+    }
+    _exit(EXIT_FAILURE);
+}
+
+/**
+ * @brief Run the command, its stdout teed into a new entry, and keep
+ * the entry if it finished (not stopped, not killed by a signal).
+ * The shell's descriptors are put back once the command has them.
+ * @param saved what redirect_save kept for the command's redirections
+ * @return the command's pid, -1 if it could not be started
+ */
+static pid_t cache_miss(cmd_t *cmd, char *path, char *key, int *saved, sigset_t sigs) {
+    char tmp[PATH_MAX + 64], final[PATH_MAX + 40];
+    cache_hdr_t hdr = {CACHE_MAGIC, 0, 0};
+    cmd_t run = *cmd;
+    int fds[2], ent, dst, status = -1;
+    pid_t pid, tee;
+    job_t *job;
+
+    snprintf(tmp, sizeof(tmp), "%s/.%s.%d", cachedir, key, getpid());
+    snprintf(final, sizeof(final), "%s/%s", cachedir, key);
+    if ((ent = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) == -1 ||
+        write(ent, &hdr, sizeof(hdr)) != sizeof(hdr) || pipe2(fds, O_CLOEXEC) == -1) {
+        fprintf(stderr, "mpsh: cached: %s: %s\n", tmp, strerror(errno));
+        if (ent != -1) {
+            close(ent);
+            unlink(tmp);
+        }
+        redirect_restore(cmd, saved);
+        return -1;
+    }
+    // the redirections are done already, the shell's stdout is where it goes
+    dst = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+    run.acts = NULL;
+    run.nacts = 0;
+    if ((pid = mpsh_spawn(&run, path, -1, fds[1], 0, sigs)) > 0) {
+        fflush(stdout);
+        if ((tee = fork()) == 0) {
+            sigprocmask(SIG_UNBLOCK, &sigs, NULL);
+            signal(SIGPIPE, SIG_DFL);
+            signal(SIGTTOU, SIG_DFL);
+            setpgid(0, pid);
+            close(fds[1]);  // or it never sees the end
+            cache_tee(fds[0], dst, ent);
+        }
+        job = addjob(&jobs, pid, FG, concatstr(cmd, 1));
+        if (tee > 0) {
+            // the tee goes first, the job's status is the command's
+            setpgid(tee, pid);
+            addproc(&jobs, job, tee);
+            proc_t p = job->procs[1];
+            job->procs[1] = job->procs[0];
+            job->procs[0] = p;
+        } else {
+            perror("mpsh: fork");
+            kill(pid, SIGKILL);
+        }
+        place_job(job, cmd->place);
+        limit_job(job, cmd->limit);
+        job->done = &status;
+    }
+    close(fds[0]);
+    close(fds[1]);
+    close(dst);
+    redirect_restore(cmd, saved);
+    if (pid <= 0) {
+        close(ent);
+        unlink(tmp);
+        return -1;
+    }
+
+    waitfg(pid);
+    if (status == -1 && (job = getjobpid(&jobs, pid)) != NULL)
+        job->done = NULL;  // stopped: it goes on without the store
+    if (status >= 0 && status < 128 && pread(ent, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+        hdr.complete) {
+        hdr.status = status;
+        if (pwrite(ent, &hdr, sizeof(hdr), 0) == sizeof(hdr) && rename(tmp, final) == 0) {
+            close(ent);
+            cache_count(0, 1, 1, 0, NULL);
+            cache_walk(1, NULL);
+            return pid;
+        }
+    }
+    close(ent);
+    unlink(tmp);
+    cache_count(0, 1, 0, 0, NULL);
+    return pid;
+}
+
+/**
+ * @brief Run a command through the store: replay it on a hit, run and
+ * store it on a miss.
+ * @param cmd the command, a program (not a builtin) in the foreground
+ * @param content key the files it names by content, not inode and mtime
+ * @param sigs signals blocked by the caller, unblocked in the child
+ * @return Always returns 1, to continue execution.
+ */
+int cache_run(cmd_t *cmd, int content, sigset_t sigs) {
+    int saved[cmd->nacts + 1], fd;
+    char key[33], path[PATH_MAX + 40], *prog;
+    cache_hdr_t hdr;
+
+    if ((prog = hash_lookup(*cmd->argv)) == NULL) {
+        printf("%s: Command not found\n", *cmd->argv);
+        last_status = 127;
+        return 1;
+    }
+    if (cache_init() == -1)
+        return mpsh_launch(cmd, sigs);
+    if (redirect_save(cmd, saved) == -1) {
+        redirect_restore(cmd, saved);
+        last_status = 1;
+        return 1;
+    }
+    // a pipe or terminal can't be keyed before the command reads it
+    if (!cache_stdin()) {
+        redirect_restore(cmd, saved);
+        return mpsh_launch(cmd, sigs);
+    }
+    cache_key(cmd, prog, content, key);
+    snprintf(path, sizeof(path), "%s/%s", cachedir, key);
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) != -1 &&
+        pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) && !memcmp(hdr.magic, CACHE_MAGIC, 8) &&
+        hdr.complete && lseek(fd, sizeof(hdr), SEEK_SET) == sizeof(hdr)) {
+        futimens(fd, NULL);  // just used, last to be evicted
+        last_status = cache_replay(fd, &hdr);
+        close(fd);
+        redirect_restore(cmd, saved);
+        cache_count(1, 0, 0, 0, NULL);
+        return 1;
+    }
+    if (fd != -1)
+        close(fd);
+    if (cache_miss(cmd, prog, key, saved, sigs) == -1)
+        last_status = 127;
+    return 1;
+}
+
+/**
+ * @brief Parse the options of cached.
+ * @param args the cached command
+ * @param content receives 1 with -c (key files by content), 0 without
+ * @return index of the command after them
+ */
+int cache_parse(char **args, int *content) {
+    *content = args[1] && !strcmp(args[1], "-c");
+    return 1 + *content;
+}
+
+/**
+ * @brief builtin cached, show the store and how often it was hit
+ * cached               the store's size, this session's and all-time hits and misses
+ * cached [-c] cmd ...  run cmd through the store (see mpsh_execute)
+ * @param ctx arguments (including program) and context.
+ * @return Always returns 1, to continue execution.
+ */
+int mpsh_cached(builtin_ctx_t *ctx) {
+    cache_stats_t total;
+    long long size;
+    int n;
+
+    if (ctx->argc > 1) {
+        // here only when it could not go through the store: a builtin, & or a pipeline
+        printf("usage: cached [-c] command [args...] (one program, in the foreground)\n");
+        last_status = 2;
+        return 1;
+    }
+    if (cache_init() == -1)
+        return 1;
+    size = cache_walk(0, &n);
+    cache_count(0, 0, 0, 0, &total);
+    printf("%s: %d entries, %.1fM\n", cachedir, n, size / 1048576.0);
+    printf("session: %lld hits, %lld misses, %lld stored\n", session.hits, session.misses,
+           session.stores);
+    printf("total:   %lld hits, %lld misses, %lld stored, %lld evicted\n", total.hits,
+           total.misses, total.stores, total.evictions);
+    return 1;
+}
@@ -0,0 +1,48 @@
+#!/bin/sh
+# check.sh - regression checks of the shell, each a line run
+# with mpsh -c and the output it must print
+#
+# usage: ./check.sh   (from src, after make)
+
+MPSH=${MPSH:-./mpsh}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+fails=0
+
+# check NAME EXPECTED LINE [STATUS] - run LINE in $TMP, compare what it
+# prints and its exit status (default 0); into a file, so a child left
+# holding it can't hang the check
+check() {
+    (cd "$TMP" && timeout 10 "$OLDPWD/$MPSH" -c "$3" > "$TMP/out" 2>&1 < /dev/null)
+    status=$?
+    got=$(cat "$TMP/out")
+    if [ "$got" = "$2" ] && [ $status -eq "${4:-0}" ]; then
+        printf "ok   %s\n" "$1"
+    else
+        printf "FAIL %s\n  expected: %s (status %s)\n  got:      %s (status %s)\n" \
+            "$1" "$2" "${4:-0}" "$got" $status
+        fails=$((fails + 1))
+    fi
+}
+
+printf 'a\nb\n' > "$TMP/items"
+
+for mode in fork spawn pool; do
+    check "cat into a builtin stage ($mode)" "X a
+X b" "launch $mode; cat items | parallel -j 1 echo X"
+done
+
+check "cat of its own output file" "cat: a: input file is output file" \
+    "echo hi > a; cat a >> a" 1
+check "launch of a bad mode" "launch: bad: expected fork, spawn or pool" "launch bad" 2
+check "hash of a missing name" "hash: nosuch: not found" "hash ls nosuch" 1
+check "printf %c of no argument" "[x][][  ]" "printf [%c][%c][%2c] xyz"
+printf 'x' > "$TMP/old"; printf 'x' > "$TMP/new"
+touch -d "2024-03-11 12:00:00.25" "$TMP/old"
+touch -d "2024-03-11 12:00:00.75" "$TMP/new"
+check "test -nt within a second" "" "test new -nt old"
+check "test -ot within a second" "" "test new -ot old" 1
+check "redirect to a glob of two files" "mpsh: *.out: ambiguous redirect" \
+    "echo > a.out; echo > b.out; echo hi > *.out" 1
+
+[ $fails -eq 0 ]
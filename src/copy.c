@@ -0,0 +1,306 @@
+/*
+ * copy - cat stages the shell runs itself
+ * a cat that only moves bytes from files or a pipe to a file
+ * or a pipe is done in the kernel with copy_file_range, splice
+ * or sendfile, without a process and without the bytes ever
+ * passing through user space
+ *
+ * @author Monthon Paul
+ * @version March 11, 2024
+ */
+#include "mpsh.h"
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+/* How bytes are moved */
+#define COPY_RANGE 0    /* copy_file_range, file to file */
+#define COPY_SPLICE 1   /* splice, one end is a pipe */
+#define COPY_SENDFILE 2 /* sendfile, from a file */
+#define COPY_RW 3       /* read + write, anything else */
+
+typedef struct copy_t {
+    int in, out;
+    int method;         /* COPY_RANGE, ... */
+    int inpipe, outpipe;
+} copy_t;
+
+static int copy_block; /* a detached child: block instead of polling */
+
+/* copy_fallback - errno telling that a method can't do these two files */
+static int copy_fallback(int err) {
+    return err == EXDEV || err == EINVAL || err == EOPNOTSUPP || err == ENOSYS || err == EBADF;
+}
+
+/* copy_chunk - Move up to MPSH_COPY_CHUNK bytes, falling back to a slower method as needed */
+static ssize_t copy_chunk(copy_t *c) {
+    static char buf[65536];
+    ssize_t n, w;
+
+    switch (c->method) {
+        case COPY_RANGE:
+            n = copy_file_range(c->in, NULL, c->out, NULL, MPSH_COPY_CHUNK, 0);
+            if (n >= 0 || !copy_fallback(errno))
+                return n;
+            c->method = COPY_SENDFILE;
+            return copy_chunk(c);
+        case COPY_SPLICE:
+            n = splice(c->in, NULL, c->out, NULL, MPSH_COPY_CHUNK,
+                       SPLICE_F_MOVE | (copy_block ? 0 : SPLICE_F_NONBLOCK));
+            if (n >= 0 || errno != EINVAL)
+                return n;
+            c->method = COPY_RW;  // e.g. a terminal, which can't be spliced to
+            return copy_chunk(c);
+        case COPY_SENDFILE:
+            n = sendfile(c->out, c->in, NULL, MPSH_COPY_CHUNK);
+            if (n >= 0 || !copy_fallback(errno))
+                return n;
+            c->method = COPY_RW;
+            return copy_chunk(c);
+    }
+    if ((n = read(c->in, buf, sizeof(buf))) <= 0)
+        return n;
+    for (ssize_t off = 0; off < n; off += w) {
+        if ((w = write(c->out, buf + off, n - off)) >= 0)
+            continue;
+        if (errno == EAGAIN)
+            ev_wait_fd(c->out, POLLOUT);
+        else if (errno != EINTR)
+            return -1;
+        w = 0;
+    }
+    return n;
+}
+
+/* copy_interrupted - ctrl-c was typed, it stays pending for the event loop */
+static int copy_interrupted(void) {
+    sigset_t set;
+    return !copy_block && sigpending(&set) == 0 && sigismember(&set, SIGINT);
+}
+
+/**
+ * @brief Carry on with the copy in a child that joins the stopped
+ * job, so fg / bg continue it with the rest of the pipeline.
+ * In the child it returns 0 and the copy goes on, blocking.
+ * @param c the copy
+ * @param job the stopped job
+ * @return 1 in the shell, 0 in the child
+ */
+static int copy_detach(copy_t *c, job_t *job) {
+    pid_t pid;
+
+    fflush(stdout);
+    if ((pid = fork()) == 0) {
+        sigprocmask(SIG_UNBLOCK, &evsigs, NULL);
+        signal(SIGPIPE, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+        setpgid(0, job->pid);
+        fcntl(c->in, F_SETFL, fcntl(c->in, F_GETFL) & ~O_NONBLOCK);
+        fcntl(c->out, F_SETFL, fcntl(c->out, F_GETFL) & ~O_NONBLOCK);
+        copy_block = 1;
+        raise(SIGSTOP);  // stopped like the rest of the job
+        return 0;
+    }
+    if (pid < 0) {
+        perror("mpsh: fork");
+        return 1;
+    }
+    setpgid(pid, job->pid);
+    addproc(&jobs, job, pid);
+    if (c->outpipe) {
+        // it stands for the first stage, the job's status is still the last one's
+        proc_t p = job->procs[job->nprocs - 1];
+        memmove(job->procs + 1, job->procs, (job->nprocs - 1) * sizeof(proc_t));
+        job->procs[0] = p;
+    }
+    return 1;
+}
+
+/**
+ * @brief Move everything from in to out.
+ * Handles signals while a pipe is full or empty.
+ * @return 0 when done, 1 if handed to a child of a stopped job, -1 on error
+ */
+static int copy_fd(int in, int out) {
+    copy_t c = {in, out, COPY_RW, 0, 0};
+    struct stat si, so;
+    ssize_t n;
+
+    if (fstat(in, &si) == 0 && fstat(out, &so) == 0) {
+        c.inpipe = S_ISFIFO(si.st_mode);
+        c.outpipe = S_ISFIFO(so.st_mode);
+        if (S_ISREG(si.st_mode) && S_ISREG(so.st_mode))
+            c.method = COPY_RANGE;
+        else if (c.inpipe || c.outpipe)
+            c.method = COPY_SPLICE;
+        else if (S_ISREG(si.st_mode))
+            c.method = COPY_SENDFILE;
+    }
+
+    while ((n = copy_chunk(&c)) != 0) {
+        if (copy_interrupted()) {
+            errno = EINTR;
+            return -1;
+        }
+        if (n > 0 || errno == EINTR)
+            continue;
+        if (errno != EAGAIN || copy_block)
+            return -1;
+
+        // a pipe is empty or full, wait for it and see to the job meanwhile
+        if (c.inpipe)
+            ev_wait_fd(in, POLLIN);
+        if (c.outpipe)
+            ev_wait_fd(out, POLLOUT);
+        if (jobs.fg != NULL && jobs.fg->state == ST && copy_detach(&c, jobs.fg))
+            return 1;
+    }
+    return 0;
+}
+
+/* copy_redirs - The < file and > or >> of a cat; -1 if it has others, left to a real cat */
+static int copy_redirs(cmd_t *cmd, char **input, fdact_t **output) {
+    *input = NULL;
+    *output = NULL;
+    for (int i = 0; i < cmd->nacts; i++) {
+        fdact_t *a = &cmd->acts[i];
+        if (a->op != FD_OPEN || a->fd > STDOUT_FILENO ||
+            (a->fd == STDIN_FILENO) != ((a->flags & O_ACCMODE) == O_RDONLY) ||
+            (a->fd == STDIN_FILENO ? *input != NULL : *output != NULL))
+            return -1;  // > a > b still makes a
+        if (a->fd == STDIN_FILENO)
+            *input = a->path;
+        else
+            *output = a;
+    }
+    return 0;
+}
+
+/**
+ * @brief Tell if a command is a plain cat, that only moves bytes:
+ * no options, so every argument is a file, and no redirections
+ * but a < file and a > or >> file.
+ * @param cmd the command
+ * @return 1 if the shell can do it, 0 otherwise
+ */
+int mpsh_is_copy(cmd_t *cmd) {
+    char *input;
+    fdact_t *output;
+
+    if (strcmp(*cmd->argv, "cat") || copy_redirs(cmd, &input, &output) == -1)
+        return 0;
+    for (int i = 1; i < cmd->argc; i++)
+        if (cmd->argv[i][0] == '-')
+            return 0;
+    return 1;
+}
+
+/**
+ * @brief Pick the stage of a pipeline the shell moves the bytes of:
+ * a first cat reading files, else a last cat reading the pipe.
+ * @param cmds the stages of the pipeline
+ * @param n number of stages
+ * @return its index, or -1
+ */
+int mpsh_copy_stage(cmd_t *cmds, int n) {
+    char *input;
+    fdact_t *output;
+
+    if (cmds[n - 1].bg)
+        return -1;  // the shell would be busy until it's done
+    if (mpsh_is_copy(&cmds[0]) && copy_redirs(&cmds[0], &input, &output) == 0 &&
+        (cmds[0].argc > 1 || input))
+        return 0;
+    if (n > 1 && mpsh_is_copy(&cmds[n - 1]) && cmds[n - 1].argc == 1 &&
+        copy_redirs(&cmds[n - 1], &input, &output) == 0 && !input)
+        return n - 1;
+    return -1;
+}
+
+/**
+ * @brief Run a cat stage in the shell. The pipe ends given
+ * are closed when done.
+ * @param cmd the cat command, with its redirections
+ * @param in pipe to read when it names no file, or -1
+ * @param out pipe to write when it has no > file, or -1 for stdout
+ * @return its exit status
+ */
+int mpsh_copy(cmd_t *cmd, int in, int out) {
+    int status = 0, ret = 0, err, dst = out;
+    handler_t *pipe_handler;
+    char *input;
+    fdact_t *output;
+    struct stat si, so;
+
+    fflush(stdout);
+    copy_redirs(cmd, &input, &output);
+    if (output)
+        dst = open(output->path, output->flags | O_CLOEXEC, 0644);
+    else if (dst == -1)
+        dst = STDOUT_FILENO;
+    if (dst == -1) {
+        fprintf(stderr, "mpsh: %s: %s\n", output->path, strerror(errno));
+        if (in != -1)
+            close(in);
+        if (out != -1)
+            close(out);
+        return 1;
+    }
+
+    pipe_handler = Signal(SIGPIPE, SIG_IGN);  // EPIPE instead
+    if (in != -1)
+        fcntl(in, F_SETFL, fcntl(in, F_GETFL) | O_NONBLOCK);
+    if (out != -1 && dst == out)
+        fcntl(out, F_SETFL, fcntl(out, F_GETFL) | O_NONBLOCK);
+
+    // every file argument in turn, or the < file, or the pipe
+    for (int i = 1; i == 1 || i < cmd->argc; i++) {
+        char *name = (i < cmd->argc) ? cmd->argv[i] : input;
+        int src = in;
+
+        if (name && (src = open(name, O_RDONLY | O_CLOEXEC)) == -1) {
+            fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+            status = 1;
+            continue;
+        }
+        // cat a >> a would read what it appends forever
+        if (fstat(src, &si) == 0 && fstat(dst, &so) == 0 && S_ISREG(so.st_mode) &&
+            si.st_dev == so.st_dev && si.st_ino == so.st_ino) {
+            fprintf(stderr, "cat: %s: input file is output file\n", name ? name : "-");
+            if (name)
+                close(src);
+            status = 1;
+            continue;
+        }
+        ret = copy_fd(src, dst);
+        err = errno;
+        if (name)
+            close(src);
+        if (ret == -1 && (err == EPIPE || err == EINTR)) {
+            status = 128 + (err == EPIPE ? SIGPIPE : SIGINT);
+            break;
+        }
+        if (ret == -1)
+            fprintf(stderr, "cat: %s: %s\n", name ? name : "-", strerror(err));
+        if (ret == -1)
+            status = 1;
+        if (ret == 1) {
+            status = 128 + SIGTSTP;  // what the shell already reported
+            break;
+        }
+    }
+    if (copy_block)
+        _exit(status);  // the detached child is done
+    if (dst != out && dst != STDOUT_FILENO)
+        close(dst);
+    if (in != -1)
+        close(in);
+    if (out != -1)
+        close(out);
+    Signal(SIGPIPE, pipe_handler);
+    return status;
+}
@@ -0,0 +1,247 @@
+/*
+ * event - the shell's event loop
+ * SIGCHLD, SIGINT and SIGTSTP stay blocked and arrive through
+ * a signalfd, watched together with the input by one epoll set,
+ * so the job list is only ever touched from ordinary code.
+ * Input lines are handed out as slices of one buffer: a large
+ * read buffer, a mapping of the script file or the -c string
+ *
+ * @author Monthon Paul
+ * @version March 11, 2024
+ */
+#include "mpsh.h"
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+
+sigset_t evsigs; /* signals delivered through the signalfd */
+
+static int sfd = -1;        /* signalfd for evsigs */
+static int epfd = -1;       /* epoll set: infd and sfd */
+
+/* Input reader state */
+static int infd = -1;       /* fd lines are read from, -1 if all in memory */
+static int infd_polled;     /* infd is in epfd (not a regular file) */
+static int infixed;         /* inbuf already holds all the input */
+static char *inbuf;         /* the input read so far */
+static size_t insize, inlen, inpos;
+static char *line;          /* copy of a last line with no room for its '\0' */
+static size_t linesize;
+
+/**
+ * @brief Block the job control signals and set up the epoll set.
+ */
+void ev_init(void) {
+    struct epoll_event ev = {.events = EPOLLIN};
+
+    sigemptyset(&evsigs);
+    sigaddset(&evsigs, SIGCHLD);
+    sigaddset(&evsigs, SIGINT);
+    sigaddset(&evsigs, SIGTSTP);
+    if (sigprocmask(SIG_BLOCK, &evsigs, NULL) < 0)
+        unix_error("sigprocmask error");
+    if ((sfd = signalfd(-1, &evsigs, SFD_CLOEXEC)) < 0)
+        unix_error("signalfd error");
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        unix_error("epoll_create1 error");
+
+    ev.data.fd = sfd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sfd, &ev) < 0)
+        unix_error("epoll_ctl error");
+}
+
+/**
+ * @brief Read commands from fd. A regular file is mapped whole,
+ * anything else is read through the buffer while epoll watches it.
+ * @param fd stdin or the script file
+ */
+void ev_input_fd(int fd) {
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = fd};
+    struct stat st;
+
+    infd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0) {
+        infd_polled = 1;
+        return;
+    }
+    if (errno != EPERM)
+        unix_error("epoll_ctl error");
+
+    // regular files can't be polled, they are always readable
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        long page = sysconf(_SC_PAGESIZE);
+        // private and writable, lines get their '\0' in place
+        char *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            inbuf = map;
+            inlen = st.st_size;
+            insize = (st.st_size + page - 1) / page * page;
+            infixed = 1;
+        }
+    }
+}
+
+/**
+ * @brief Read commands from a string (mpsh -c).
+ * @param s the commands, one per line
+ */
+void ev_input_string(char *s) {
+    inbuf = s;
+    inlen = strlen(s);
+    insize = inlen + 1;
+    infixed = 1;
+}
+
+/**
+ * @brief Read the pending signals off the signalfd and act on them.
+ * Blocks until at least one signal is there.
+ */
+void ev_signals(void) {
+    struct signalfd_siginfo si[16];
+    ssize_t n;
+    int chld = 0;
+
+    while ((n = read(sfd, si, sizeof(si))) < 0 && errno == EINTR) {
+    }
+    if (n < 0)
+        unix_error("signalfd read error");
+    for (int i = 0; i < n / sizeof(*si); i++) {
+        switch (si[i].ssi_signo) {
+            case SIGCHLD:
+                chld = 1;  // one reap loop covers them all
+                break;
+            case SIGINT:
+                sigint_handler(SIGINT);
+                break;
+            case SIGTSTP:
+                sigtstp_handler(SIGTSTP);
+                break;
+        }
+    }
+    if (chld)
+        sigchld_handler(SIGCHLD);
+}
+
+/**
+ * @brief Wait until fd is ready, or signals came in and were handled.
+ * @param fd a pipe or another descriptor poll works on
+ * @param events POLLIN or POLLOUT
+ */
+void ev_wait_fd(int fd, int events) {
+    struct pollfd p[2] = {{.fd = sfd, .events = POLLIN}, {.fd = fd, .events = events}};
+
+    while (poll(p, 2, -1) < 0) {
+        if (errno != EINTR)
+            unix_error("poll error");
+    }
+    if (p[0].revents)
+        ev_signals();
+}
+
+/**
+ * @brief Handle signals until stdin has input.
+ * @param block wait for input, or just handle what is pending
+ */
+static void ev_wait_input(int block) {
+    struct epoll_event evs[2];
+    int n, ready = 0;
+
+    // regular files are always ready, only look at the signals
+    if (!infd_polled)
+        block = 0;
+    while (!ready) {
+        while ((n = epoll_wait(epfd, evs, 2, block ? -1 : 0)) < 0 && errno == EINTR) {
+        }
+        if (n < 0)
+            unix_error("epoll_wait error");
+        for (int i = 0; i < n; i++) {
+            if (evs[i].data.fd == sfd)
+                ev_signals();
+            else
+                ready = 1;
+        }
+        if (!block)
+            return;
+    }
+}
+
+/**
+ * @brief Read a line of input.
+ * Reaps children and forwards signals while waiting for input.
+ * @return The line without its newline, valid until the next call,
+ *         or NULL at the end of the input.
+ */
+char *mpsh_read_line() {
+    char *nl, *l;
+
+    // children exit while we run through buffered lines too
+    ev_wait_input(0);
+    while ((nl = memchr(inbuf + inpos, '\n', inlen - inpos)) == NULL) {
+        if (infixed) {
+            if (inpos == inlen)
+                return NULL;  // We recieved an EOF
+            break;
+        }
+
+        // keep the partial line, make room for more
+        if (inpos) {
+            memmove(inbuf, inbuf + inpos, inlen - inpos);
+            inlen -= inpos;
+            inpos = 0;
+        }
+        if (inlen == insize) {
+            insize = insize ? insize * 2 : MPSH_INBUF_SIZE;
+            if ((inbuf = realloc(inbuf, insize)) == NULL) {
+                fprintf(stderr, "mpsh: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        fflush(stdout);  // the prompt
+        ev_wait_input(1);
+        ssize_t n = read(infd, inbuf + inlen, insize - inlen);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            perror("mpsh: readline");
+            exit(EXIT_FAILURE);
+        }
+        if (n == 0) {
+            if (inlen == 0)
+                return NULL;  // We recieved an EOF
+            infixed = 1;      // last line without a newline
+            break;
+        }
+        inlen += n;
+    }
+
+    l = inbuf + inpos;
+    if (nl) {
+        *nl = '\0';
+        inpos = nl + 1 - inbuf;
+        return l;
+    }
+    // last line without a newline, terminate it in place if there is room
+    inpos = inlen;
+    if (inlen < insize) {
+        inbuf[inlen] = '\0';
+        return l;
+    }
+    if (inlen - (l - inbuf) + 1 > linesize) {
+        linesize = inlen - (l - inbuf) + 1;
+        if ((line = realloc(line, linesize)) == NULL) {
+            fprintf(stderr, "mpsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(line, l, inlen - (l - inbuf));
+    line[inlen - (l - inbuf)] = '\0';
+    return line;
+}
@@ -0,0 +1,331 @@
+/*
+ * glob - expand *, ?, [...] and ** in words
+ * directories are read with getdents64 into one reused buffer,
+ * and only the names that match are kept; d_type says which are
+ * directories, so stat is only needed for symlinks and file systems
+ * that don't fill it in. Directories read for a pipeline are kept for
+ * the rest of it in the line's arena, so `ls *.c *.h` reads . once
+ *
+ * @author Monthon Paul
+ * @version March 11, 2024
+ */
+#include "mpsh.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+typedef struct gchunk_t {  /* What one getdents64 call returned */
+    struct gchunk_t *next;
+    size_t len;
+    char data[];
+} gchunk_t;
+
+typedef struct gdir_t {    /* A directory read during this pipeline */
+    struct gdir_t *next;
+    char *path;
+    gchunk_t *chunks, **tail;
+} gdir_t;
+
+typedef struct gent_t {    /* A matching entry */
+    char *name;
+    unsigned char type;    /* d_type */
+} gent_t;
+
+typedef struct gstate_t {  /* One expansion */
+    arena_t *a;
+    char path[PATH_MAX];   /* directory being looked at, then the match */
+} gstate_t;
+
+static char dbuf[MPSH_GLOB_BUF];  /* getdents64 buffer */
+static gdir_t *dirs;               /* read this pipeline, in the line's arena */
+static int nocache = -1;           /* $MPSH_GLOB_NOCACHE: read every time */
+static char **res;                 /* matches of the current expansion */
+static size_t nres, rescap;
+
+/* glob_class - Match c against the [...] at p; the end of it, NULL if it isn't one */
+static const char *glob_class(const char *p, unsigned char c, int *hit) {
+    int neg = 0;
+
+    *hit = 0;
+    p++;
+    if (*p == '!' || *p == '^') {
+        neg = 1;
+        p++;
+    }
+    // a ] right after [ or [! is one of the characters
+    for (int first = 1; *p && (*p != ']' || first); first = 0) {
+        unsigned char lo = *p, hi;
+        if (lo == '\\' && p[1])
+            lo = *++p;
+        hi = lo;
+        p++;
+        if (*p == '-' && p[1] && p[1] != ']') {
+            hi = *++p;
+            if (hi == '\\' && p[1])
+                hi = *++p;
+            p++;
+        }
+        if (lo <= c && c <= hi)
+            *hit = 1;
+    }
+    if (*p != ']')
+        return NULL;  // no closing ]: a plain [
+    *hit ^= neg;
+    return p + 1;
+}
+
+/* glob_match - Does name s match the pattern p, one path component */
+static int glob_match(const char *p, const char *s) {
+    const char *pstar = NULL, *sstar = NULL, *e;
+    int hit;
+
+    while (*s) {
+        if (*p == '*') {
+            pstar = ++p;
+            sstar = s;
+            continue;
+        } else if (*p == '?') {
+            p++;
+            s++;
+            continue;
+        } else if (*p == '[' && (e = glob_class(p, *s, &hit)) != NULL) {
+            if (hit) {
+                p = e;
+                s++;
+                continue;
+            }
+        } else {
+            if (*p == '\\' && p[1])
+                p++;
+            if (*p == *s) {
+                p++;
+                s++;
+                continue;
+            }
+        }
+        // mismatch: let the last * take one more character
+        if (!pstar)
+            return 0;
+        p = pstar;
+        s = ++sstar;
+    }
+    while (*p == '*')
+        p++;
+    return *p == '\0';
+}
+
+/**
+ * @brief Does a word hold glob characters.
+ * @param w the word
+ * @return 1 if it has an unescaped *, ? or [...]
+ */
+int glob_meta(const char *w) {
+    int hit;
+
+    for (; *w; w++) {
+        if (*w == '\\' && w[1])
+            w++;
+        else if (*w == '*' || *w == '?' || (*w == '[' && glob_class(w, 0, &hit)))
+            return 1;
+    }
+    return 0;
+}
+
+/* glob_add - Keep path[0..len) as a match */
+static void glob_add(gstate_t *g, size_t len) {
+    if (nres == rescap) {
+        rescap = rescap ? rescap * 2 : 64;
+        if ((res = realloc(res, rescap * sizeof(char *))) == NULL) {
+            fprintf(stderr, "mpsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    res[nres] = arena_alloc(g->a, len + 1);
+    memcpy(res[nres], g->path, len);
+    res[nres++][len] = '\0';
+}
+
+/* glob_filter - Add the entries of a getdents64 buffer matching pat (NULL: all but hidden) */
+static void glob_filter(gstate_t *g, char *buf, size_t len, const char *pat, gent_t **ents,
+                        int *n, int *cap) {
+    for (size_t off = 0; off < len;) {
+        struct dirent64 *d = (struct dirent64 *)(buf + off);
+        char *name = d->d_name;
+
+        off += d->d_reclen;
+        // hidden names only for a pattern that starts with a dot, never . and ..
+        if (name[0] == '.' && (!pat || pat[0] != '.' || !name[1] || (name[1] == '.' && !name[2])))
+            continue;
+        if (pat && !glob_match(pat, name))
+            continue;
+        if (*n == *cap) {
+            *cap = *cap ? *cap * 2 : 64;
+            if ((*ents = realloc(*ents, *cap * sizeof(gent_t))) == NULL) {
+                fprintf(stderr, "mpsh: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        (*ents)[*n].name = arena_strdup(g->a, name);
+        (*ents)[(*n)++].type = d->d_type;
+    }
+}
+
+/* glob_scan - Entries of the directory path[0..len) matching pat, malloc'd */
+static gent_t *glob_scan(gstate_t *g, size_t len, const char *pat, int *n) {
+    char *dir = len ? g->path : ".";
+    gent_t *ents = NULL;
+    gdir_t *d;
+    gchunk_t *c;
+    long r;
+    int fd, cap = 0;
+
+    *n = 0;
+    g->path[len] = '\0';
+    for (d = dirs; d && strcmp(d->path, dir); d = d->next) {
+    }
+    if (d) {
+        for (c = d->chunks; c; c = c->next)
+            glob_filter(g, c->data, c->len, pat, &ents, n, &cap);
+        return ents;
+    }
+    if ((fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+        return NULL;
+    if (!nocache) {
+        d = arena_alloc(g->a, sizeof(gdir_t));
+        d->path = arena_strdup(g->a, dir);
+        d->chunks = NULL;
+        d->tail = &d->chunks;
+    }
+    while ((r = syscall(SYS_getdents64, fd, dbuf, sizeof(dbuf))) > 0) {
+        if (d) {
+            c = arena_alloc(g->a, sizeof(gchunk_t) + r);
+            c->next = NULL;
+            c->len = r;
+            memcpy(c->data, dbuf, r);
+            *d->tail = c;
+            d->tail = &c->next;
+        }
+        glob_filter(g, dbuf, r, pat, &ents, n, &cap);
+    }
+    close(fd);
+    // only a directory read to the end is worth remembering
+    if (d && r == 0) {
+        d->next = dirs;
+        dirs = d;
+    }
+    return ents;
+}
+
+/* glob_isdir - Is the entry at path[0..len) a directory, following symlinks if asked */
+static int glob_isdir(gstate_t *g, size_t len, unsigned char type, int follow) {
+    struct stat st;
+
+    if (type == DT_DIR)
+        return 1;
+    if (type != DT_UNKNOWN && (type != DT_LNK || !follow))
+        return 0;
+    g->path[len] = '\0';
+    return (follow ? stat(g->path, &st) : lstat(g->path, &st)) == 0 && S_ISDIR(st.st_mode);
+}
+
+/* glob_walk - Match the components comp in the directory path[0..len) */
+static void glob_walk(gstate_t *g, size_t len, char **comp) {
+    int star2 = !strcmp(*comp, "**"), n;
+    struct stat st;
+    gent_t *ents;
+
+    if (!star2 && !glob_meta(*comp)) {
+        // nothing to match: no need to read the directory
+        size_t l = 0;
+        for (char *p = *comp; *p && len + l < PATH_MAX - 2; p++) {
+            if (*p == '\\' && p[1])
+                p++;
+            g->path[len + l++] = *p;
+        }
+        if (comp[1]) {
+            g->path[len + l] = '/';
+            glob_walk(g, len + l + 1, comp + 1);
+        } else {
+            g->path[len + l] = '\0';
+            if (lstat(g->path, &st) == 0)
+                glob_add(g, len + l);
+        }
+        return;
+    }
+
+    // ** is zero or more directories
+    if (star2 && comp[1])
+        glob_walk(g, len, comp + 1);
+    ents = glob_scan(g, len, star2 ? NULL : *comp, &n);
+    for (int i = 0; i < n; i++) {
+        size_t l = strlen(ents[i].name);
+        if (len + l >= PATH_MAX - 2)
+            continue;
+        memcpy(g->path + len, ents[i].name, l);
+        if (star2) {
+            if (!comp[1])
+                glob_add(g, len + l);
+            // not through symlinks, which could loop
+            if (glob_isdir(g, len + l, ents[i].type, 0)) {
+                g->path[len + l] = '/';
+                glob_walk(g, len + l + 1, comp);
+            }
+        } else if (!comp[1]) {
+            glob_add(g, len + l);
+        } else if (glob_isdir(g, len + l, ents[i].type, 1)) {
+            g->path[len + l] = '/';
+            glob_walk(g, len + l + 1, comp + 1);
+        }
+    }
+    free(ents);
+}
+
+/* globcmp - qsort order of matches */
+static int globcmp(const void *a, const void *b) {
+    return strcmp(*(char **)a, *(char **)b);
+}
+
+/**
+ * @brief Expand a glob pattern: *, ?, [...] within a name,
+ * and ** for any number of directories.
+ * @param pattern the word
+ * @param a arena for the matches, and the directories read
+ * @param matches receives the sorted matches, valid until the next call
+ * @return number of matches, 0 if none
+ */
+int mpsh_glob(const char *pattern, arena_t *a, char ***matches) {
+    gstate_t *g = arena_alloc(a, sizeof(gstate_t));
+    char *pat = arena_strdup(a, pattern), *comp[PATH_MAX / 2 + 2], *save;
+    int ncomp = 0;
+    size_t len = 0;
+
+    if (nocache == -1)
+        nocache = getenv("MPSH_GLOB_NOCACHE") != NULL;
+    g->a = a;
+    nres = 0;
+    if (*pat == '/')
+        g->path[len++] = '/';
+    for (char *p = strtok_r(pat, "/", &save); p; p = strtok_r(NULL, "/", &save))
+        comp[ncomp++] = p;
+    if (ncomp && pattern[strlen(pattern) - 1] == '/')
+        comp[ncomp++] = "";  // */ matches directories only
+    comp[ncomp] = NULL;
+    if (ncomp)
+        glob_walk(g, len, comp);
+
+    qsort(res, nres, sizeof(char *), globcmp);
+    *matches = res;
+    return nres;
+}
+
+/**
+ * @brief Forget the directories read, at the start of a pipeline,
+ * so it sees what the ones before it made.
+ */
+void glob_reset(void) {
+    dirs = NULL;
+}
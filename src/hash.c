@@ -0,0 +1,213 @@
+/*
+ * hash - remembers where commands live in $PATH
+ * so a command is searched for once, in the parent,
+ * instead of by execvp in every child after the fork
+ *
+ * @author Monthon Paul
+ * @version March 11, 2024
+ */
+#include "mpsh.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define DEFAULT_PATH "/bin:/usr/bin"
+
+typedef struct hashent_t {
+    char *name;    /* command name, NULL if the slot is free */
+    char *path;    /* absolute path it resolved to */
+    unsigned hits; /* times the entry was used */
+} hashent_t;
+
+static hashent_t *table;    /* open addressing, size is a power of 2 */
+static size_t tabsize, nent;
+static char *hashed_path;   /* $PATH the table was filled from */
+
+/* strhash - FNV-1a hash of a string */
+static size_t strhash(const char *s) {
+    size_t h = 14695981039346656037ULL;
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 1099511628211ULL;
+    return h;
+}
+
+/* hash_slot - slot holding name, or the free slot it would go in */
+static hashent_t *hash_slot(const char *name) {
+    size_t i = strhash(name) & (tabsize - 1);
+    while (table[i].name && strcmp(table[i].name, name))
+        i = (i + 1) & (tabsize - 1);
+    return &table[i];
+}
+
+/* hash_insert - Add name -> path to the table, growing it when 3/4 full */
+static hashent_t *hash_insert(const char *name, const char *path) {
+    if ((nent + 1) * 4 > tabsize * 3) {
+        hashent_t *old = table;
+        size_t oldsize = tabsize;
+        tabsize = tabsize ? tabsize * 2 : MPSH_HASH_SIZE;
+        table = calloc(tabsize, sizeof(hashent_t));
+        if (!table) {
+            fprintf(stderr, "mpsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < oldsize; i++)
+            if (old[i].name)
+                *hash_slot(old[i].name) = old[i];
+        free(old);
+    }
+    hashent_t *ent = hash_slot(name);
+    ent->name = strdup(name);
+    ent->path = strdup(path);
+    ent->hits = 0;
+    nent++;
+    return ent;
+}
+
+/**
+ * @brief Forget every remembered command.
+ */
+void hash_clear(void) {
+    for (size_t i = 0; i < tabsize; i++) {
+        free(table[i].name);
+        free(table[i].path);
+    }
+    memset(table, 0, tabsize * sizeof(hashent_t));
+    nent = 0;
+}
+
+/**
+ * @brief Forget one command, e.g. after its binary went away.
+ * @param name command name
+ */
+void hash_forget(const char *name) {
+    if (!tabsize)
+        return;
+    hashent_t *ent = hash_slot(name);
+    if (!ent->name)
+        return;
+    free(ent->name);
+    free(ent->path);
+    ent->name = NULL;
+    nent--;
+
+    // re-seat the rest of the cluster so probing still finds them
+    size_t i = (ent - table + 1) & (tabsize - 1);
+    while (table[i].name) {
+        hashent_t moved = table[i];
+        table[i].name = NULL;
+        *hash_slot(moved.name) = moved;
+        i = (i + 1) & (tabsize - 1);
+    }
+}
+
+/**
+ * @brief Search $PATH for an executable file the way execvp does.
+ * @param name command name (no slash)
+ * @param buf receives the full path
+ * @param size size of buf
+ * @return 1 if found, 0 otherwise
+ */
+static int path_search(const char *name, char *buf, size_t size) {
+    const char *path = getenv("PATH"), *dir, *end;
+    struct stat st;
+
+    if (!path)
+        path = DEFAULT_PATH;
+    for (dir = path; ; dir = end + 1) {
+        end = strchrnul(dir, ':');
+        if (end == dir)  // empty entry means the current directory
+            snprintf(buf, size, "%s", name);
+        else
+            snprintf(buf, size, "%.*s/%s", (int)(end - dir), dir, name);
+        if (stat(buf, &st) == 0 && S_ISREG(st.st_mode) && access(buf, X_OK) == 0)
+            return 1;
+        if (!*end)
+            return 0;
+    }
+}
+
+/**
+ * @brief Resolve a command name to the file to exec.
+ * Names with a slash are used as is, everything else
+ * is looked up in $PATH once and remembered.
+ * @param name command name
+ * @return the path to exec, or NULL if the command was not found
+ */
+char *hash_lookup(char *name) {
+    const char *path = getenv("PATH");
+    char buf[PATH_MAX];
+
+    if (strchr(name, '/'))
+        return name;
+
+    // a new $PATH makes every remembered location suspect
+    if (!path)
+        path = DEFAULT_PATH;
+    if (!hashed_path || strcmp(hashed_path, path)) {
+        if (nent)
+            hash_clear();
+        free(hashed_path);
+        hashed_path = strdup(path);
+    }
+
+    if (tabsize) {
+        hashent_t *ent = hash_slot(name);
+        if (ent->name) {
+            ent->hits++;
+            return ent->path;
+        }
+    }
+    if (!path_search(name, buf, sizeof(buf)))
+        return NULL;
+    hashent_t *ent = hash_insert(name, buf);
+    ent->hits++;
+    return ent->path;
+}
+
+/**
+ * @brief exec resolved path, falling back to a $PATH search
+ * if the remembered file is gone. Only returns on failure.
+ * @param path path from hash_lookup
+ * @param args list of arguments (including program).
+ */
+void hash_exec(char *path, char **args) {
+    execv(path, args);
+    if (errno == ENOENT && strcmp(path, *args))
+        execvp(*args, args);
+}
+
+/**
+ * @brief builtin hash, list or reset remembered commands
+ * hash        list remembered commands and their hit counts
+ * hash -r     forget every remembered command
+ * hash name   look up name and remember it
+ * @param ctx arguments (including program) and context.
+ * @return Always returns 1, to continue execution.
+ */
+int mpsh_hash(builtin_ctx_t *ctx) {
+    char **args = ctx->argv;
+    if (args[1] && !strcmp(args[1], "-r")) {
+        hash_clear();
+        return 1;
+    }
+    if (args[1]) {
+        for (int i = 1; args[i] != NULL; i++) {
+            if (!hash_lookup(args[i])) {
+                printf("hash: %s: not found\n", args[i]);
+                last_status = 1;
+            }
+        }
+        return 1;
+    }
+    if (!nent) {
+        printf("hash: hash table empty\n");
+        return 1;
+    }
+    printf("hits\tcommand\n");
+    for (size_t i = 0; i < tabsize; i++)
+        if (table[i].name)
+            printf("%4u\t%s\n", table[i].hits, table[i].path);
+    return 1;
+}
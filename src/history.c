@@ -0,0 +1,438 @@
+/*
+ * history - lines entered, kept in a file across sessions
+ * each line is one record appended to the file, which is mapped
+ * rather than read: at startup only the last MPSH_HISTSIZE records
+ * are found, walking back from the end by their trailers, so it
+ * takes as long with a million lines as with ten. Searching the
+ * whole file goes through a trigram index, built on first use.
+ * Sessions share the file: each record is one O_APPEND write, so
+ * writers never take a lock or tear each other's records, and each
+ * session reads only the bytes added since it last looked; a record
+ * that doesn't check out (a writer killed mid-write) is skipped by
+ * looking for the next header
+ *
+ * @author Monthon Paul
+ * @version March 11, 2024
+ */
+#include "mpsh.h"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define HIST_MAGIC 0x6873706d /* "mpsh" */
+
+typedef struct hist_rec_t { /* Record header, the line and its length follow */
+    uint32_t magic;
+    uint32_t len;           /* bytes of the line, with its '\0' */
+    uint32_t crc;           /* CRC-32 of the line */
+} hist_rec_t;
+
+typedef struct posting_t {  /* Records holding one trigram (or one sharing its slot) */
+    uint32_t *ids;
+    uint32_t n, cap;
+} posting_t;
+
+static int hist_fd = -1;       /* the history file */
+static char *hist_map;         /* mapped, hist_maplen bytes may exceed the file */
+static size_t hist_maplen;
+static off_t hist_size;        /* bytes of records known */
+
+static off_t *ring;            /* offsets of the last lines, oldest at ring_head */
+static int ring_cap, ring_n, ring_head;
+static unsigned long ring_first; /* number of the oldest line */
+
+static off_t *recs;            /* offsets of every record, once indexed */
+static uint32_t nrecs, recs_cap;
+static off_t indexed = -1;     /* bytes of the file indexed, -1 before the first search */
+static posting_t *trigrams;    /* MPSH_HIST_TRIGRAMS slots */
+
+static char *exbuf;            /* line after ! expansion */
+static size_t excap;
+
+/* hist_crc - CRC-32 (IEEE) of a buffer */
+static uint32_t hist_crc(const char *p, size_t n) {
+    static uint32_t table[256];
+    uint32_t c = 0xffffffff;
+
+    if (table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t t = i;
+            for (int k = 0; k < 8; k++)
+                t = (t & 1) ? 0xedb88320 ^ (t >> 1) : t >> 1;
+            table[i] = t;
+        }
+    }
+    while (n--)
+        c = table[(c ^ (unsigned char)*p++) & 0xff] ^ (c >> 8);
+    return c ^ 0xffffffff;
+}
+
+/* hist_mapto - Map the file up to size bytes, with room to grow */
+static int hist_mapto(off_t size) {
+    size_t len = hist_maplen ? hist_maplen : 1 << 20;
+    void *p;
+
+    if ((size_t)size <= hist_maplen)
+        return 0;
+    while (len < (size_t)size)
+        len *= 2;
+    // pages past the end of the file are mapped but never touched
+    if (hist_map)
+        p = mremap(hist_map, hist_maplen, len, MREMAP_MAYMOVE);
+    else
+        p = mmap(NULL, len, PROT_READ, MAP_SHARED, hist_fd, 0);
+    if (p == MAP_FAILED)
+        return -1;
+    hist_map = p;
+    hist_maplen = len;
+    return 0;
+}
+
+/* hist_valid - Length of the line of the record at off, 0 if it isn't one */
+static uint32_t hist_valid(off_t off, off_t end) {
+    hist_rec_t rec;
+    uint32_t trailer;
+
+    if (off < 0 || off + (off_t)sizeof(rec) > end)
+        return 0;
+    memcpy(&rec, hist_map + off, sizeof(rec));
+    if (rec.magic != HIST_MAGIC || rec.len == 0 ||
+        off + (off_t)(sizeof(rec) + rec.len + sizeof(trailer)) > end)
+        return 0;
+    memcpy(&trailer, hist_map + off + sizeof(rec) + rec.len, sizeof(trailer));
+    if (trailer != rec.len || hist_map[off + sizeof(rec) + rec.len - 1] != '\0' ||
+        hist_crc(hist_map + off + sizeof(rec), rec.len) != rec.crc)
+        return 0;
+    return rec.len;
+}
+
+/* hist_reclen - Bytes of a record holding a line of len bytes */
+static off_t hist_reclen(uint32_t len) {
+    return sizeof(hist_rec_t) + len + sizeof(uint32_t);
+}
+
+/* hist_line - The line of the record at off */
+static char *hist_line(off_t off) {
+    return hist_map + off + sizeof(hist_rec_t);
+}
+
+/* hist_next - First record at or after off, -1 if there is none before end */
+static off_t hist_next(off_t off, off_t end) {
+    uint32_t magic = HIST_MAGIC;
+    char *p;
+
+    while (off < end && !hist_valid(off, end)) {
+        // not a record: resync at the next header
+        if ((p = memmem(hist_map + off + 1, end - off - 1, &magic, sizeof(magic))) == NULL)
+            return -1;
+        off = p - hist_map;
+    }
+    return off < end ? off : -1;
+}
+
+/* hist_prev - Last record ending by end, -1 if there is none */
+static off_t hist_prev(off_t end) {
+    uint32_t magic = HIST_MAGIC, len;
+
+    if (end >= hist_reclen(1)) {
+        memcpy(&len, hist_map + end - sizeof(len), sizeof(len));
+        if (len <= end && hist_valid(end - hist_reclen(len), end) == len)
+            return end - hist_reclen(len);
+    }
+    // a torn write at the end, or garbage: search back for a header
+    for (off_t off = end - hist_reclen(1); off >= 0; off--)
+        if (!memcmp(hist_map + off, &magic, sizeof(magic)) && hist_valid(off, end))
+            return off;
+    return -1;
+}
+
+/* hist_nth - Offset of the line numbered n, -1 if it isn't in the ring */
+static off_t hist_nth(unsigned long n) {
+    if (n < ring_first || n >= ring_first + ring_n)
+        return -1;
+    return ring[(ring_head + (n - ring_first)) % ring_cap];
+}
+
+/* hist_push - Add the record at off to the ring, dropping the oldest when full */
+static void hist_push(off_t off) {
+    if (ring_n == ring_cap) {
+        ring[ring_head] = off;
+        ring_head = (ring_head + 1) % ring_cap;
+        ring_first++;
+    } else {
+        ring[(ring_head + ring_n++) % ring_cap] = off;
+    }
+}
+
+/* tri_slot - Posting list for the trigram at p */
+static posting_t *tri_slot(const char *p) {
+    uint32_t t = (unsigned char)p[0] << 16 | (unsigned char)p[1] << 8 | (unsigned char)p[2];
+    return &trigrams[(t * 2654435761u) >> 16 & (MPSH_HIST_TRIGRAMS - 1)];
+}
+
+/* hist_index - Add the record at off to the search index */
+static void hist_index(off_t off) {
+    char *line = hist_line(off);
+
+    if (nrecs == recs_cap) {
+        recs_cap = recs_cap ? recs_cap * 2 : 1024;
+        if ((recs = realloc(recs, recs_cap * sizeof(off_t))) == NULL)
+            unix_error("mpsh: history");
+    }
+    recs[nrecs] = off;
+    for (size_t i = 0; line[i] && line[i + 1] && line[i + 2]; i++) {
+        posting_t *p = tri_slot(line + i);
+        if (p->n && p->ids[p->n - 1] == nrecs)
+            continue;  // trigram seen earlier in the line
+        if (p->n == p->cap) {
+            p->cap = p->cap ? p->cap * 2 : 4;
+            if ((p->ids = realloc(p->ids, p->cap * sizeof(uint32_t))) == NULL)
+                unix_error("mpsh: history");
+        }
+        p->ids[p->n++] = nrecs;
+    }
+    nrecs++;
+}
+
+/* hist_index_sync - Index the records added since the last search */
+static void hist_index_sync(void) {
+    off_t off;
+
+    if (indexed == -1) {
+        if ((trigrams = calloc(MPSH_HIST_TRIGRAMS, sizeof(posting_t))) == NULL) {
+            fprintf(stderr, "mpsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        indexed = 0;
+    }
+    while ((off = hist_next(indexed, hist_size)) != -1) {
+        hist_index(off);
+        indexed = off + hist_reclen(hist_valid(off, hist_size));
+    }
+}
+
+/**
+ * @brief Open the history, and load its last lines.
+ * @param file the history file, or NULL to keep it for this session only
+ */
+void hist_init(const char *file) {
+    char *size = getenv("MPSH_HISTSIZE");
+    struct stat st;
+    off_t end, *back;
+    int n = 0;
+
+    ring_cap = (size && atoi(size) > 0) ? atoi(size) : MPSH_HISTSIZE;
+    ring_first = 1;
+    if ((ring = malloc(ring_cap * sizeof(off_t))) == NULL) {
+        fprintf(stderr, "mpsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    if (file)
+        hist_fd = open(file, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (hist_fd == -1) {
+        if (file)
+            fprintf(stderr, "mpsh: %s: %s\n", file, strerror(errno));
+        hist_fd = memfd_create("history", MFD_CLOEXEC);
+    }
+    if (hist_fd == -1 || fstat(hist_fd, &st) == -1 || hist_mapto(st.st_size ? st.st_size : 1)) {
+        perror("mpsh: history");
+        exit(EXIT_FAILURE);
+    }
+
+    // walk back from the end, as far as the ring holds
+    if ((back = malloc(ring_cap * sizeof(off_t))) == NULL) {
+        fprintf(stderr, "mpsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (end = st.st_size; n < ring_cap && (back[n] = hist_prev(end)) != -1; end = back[n++]) {
+    }
+    // later sessions' records are read from the end of the newest one
+    hist_size = n ? back[0] + hist_reclen(hist_valid(back[0], st.st_size)) : 0;
+    while (n > 0)
+        hist_push(back[--n]);
+    free(back);
+}
+
+/**
+ * @brief Take in the lines other sessions have added since we last looked.
+ */
+void hist_tail(void) {
+    struct stat st;
+    off_t off;
+
+    if (fstat(hist_fd, &st) == -1 || st.st_size <= hist_size || hist_mapto(st.st_size) == -1)
+        return;
+    // a record still being written stays for next time
+    while ((off = hist_next(hist_size, st.st_size)) != -1) {
+        hist_push(off);
+        hist_size = off + hist_reclen(hist_valid(off, st.st_size));
+    }
+}
+
+/**
+ * @brief Append a line to the history file, and take it (and any
+ * other session's lines before it) into the ring.
+ * @param line the line
+ */
+void hist_add(const char *line) {
+    uint32_t len = strlen(line) + 1;
+    hist_rec_t rec = {HIST_MAGIC, len, hist_crc(line, len)};
+    struct iovec iov[3] = {{&rec, sizeof(rec)}, {(char *)line, len}, {&len, sizeof(len)}};
+
+    // one O_APPEND write: lands whole, after whatever other sessions wrote
+    if (writev(hist_fd, iov, 3) != hist_reclen(len))
+        perror("mpsh: history");
+    hist_tail();
+}
+
+/* hist_find - The line a ! word refers to: !!, !N, !-N or !prefix */
+static char *hist_find(const char *word, size_t n) {
+    unsigned long last = ring_first + ring_n - 1;
+    char *end;
+    off_t off = -1;
+
+    if (ring_n == 0)
+        return NULL;
+    if (n == 2 && word[1] == '!') {
+        off = hist_nth(last);
+    } else if (isdigit((unsigned char)word[1]) || (word[1] == '-' && n > 2)) {
+        long k = strtol(word + 1, &end, 10);
+        if (end == word + n)
+            off = hist_nth(k < 0 ? last + 1 + k : (unsigned long)k);
+    } else {
+        for (unsigned long i = last; i >= ring_first && off == -1; i--)
+            if (!strncmp(hist_line(hist_nth(i)), word + 1, n - 1))
+                off = hist_nth(i);
+    }
+    return off == -1 ? NULL : hist_line(off);
+}
+
+/* hist_append - Append n bytes to the expansion buffer */
+static void hist_append(size_t *len, const char *s, size_t n) {
+    if (*len + n + 1 > excap) {
+        excap = (*len + n + 1) * 2;
+        if ((exbuf = realloc(exbuf, excap)) == NULL) {
+            fprintf(stderr, "mpsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(exbuf + *len, s, n);
+    *len += n;
+    exbuf[*len] = '\0';
+}
+
+/* hist_quote - Follow the quotes of s[0..n): the quote still open, and if a \ escapes s[n] */
+static char hist_quote(const char *s, size_t n, char q, int *esc) {
+    for (size_t i = 0; i < n; i++) {
+        if (*esc)
+            *esc = 0;
+        else if (s[i] == '\\' && q != '\'')
+            *esc = 1;
+        else if (q == 0 && (s[i] == '\'' || s[i] == '"'))
+            q = s[i];
+        else if (s[i] == q)
+            q = 0;
+    }
+    return q;
+}
+
+/**
+ * @brief A line entered at the prompt: expand the words starting
+ * with ! (!!, !N, !-N, !prefix), and add it to the history. A !
+ * in single quotes or after a \ is left as it is.
+ * @param line the line
+ * @return the line to run, line itself or the expansion (valid until
+ *         the next call), or NULL if a ! word matched nothing
+ */
+char *hist_enter(char *line) {
+    size_t len = 0, n;
+    int expanded = 0, esc = 0, joined = 0;
+    char *p = line, *found, q = 0;
+
+    hist_tail();
+    while (*p) {
+        n = strcspn(p, MPSH_TOK_DELIM);
+        // a lone ! (test) and != are not history, nor a quoted one
+        if (n > 1 && p[0] == '!' && p[1] != '=' && q != '\'' && !esc && !joined) {
+            if ((found = hist_find(p, n)) == NULL) {
+                fprintf(stderr, "mpsh: %.*s: event not found\n", (int)n, p);
+                return NULL;
+            }
+            hist_append(&len, found, strlen(found));
+            expanded = 1;
+        } else {
+            hist_append(&len, p, n);
+        }
+        q = hist_quote(p, n, q, &esc);
+        p += n;
+        n = strspn(p, MPSH_TOK_DELIM);
+        hist_append(&len, p, n);
+        // a\ !! is one word, the ! is not at its start
+        joined = (esc && n == 1);
+        q = hist_quote(p, n, q, &esc);
+        p += n;
+    }
+    if (expanded) {
+        line = exbuf;
+        printf("%s\n", line);
+    }
+    hist_add(line);
+    return line;
+}
+
+/* hist_search - Print every line of the file holding text, oldest first */
+static void hist_search(const char *text) {
+    size_t tlen = strlen(text);
+    posting_t *best = NULL;
+
+    hist_index_sync();
+    if (tlen < 3) {
+        for (uint32_t i = 0; i < nrecs; i++)
+            if (strstr(hist_line(recs[i]), text))
+                printf("%s\n", hist_line(recs[i]));
+        return;
+    }
+    // candidates: the records of the rarest trigram of the text
+    for (size_t i = 0; i + 2 < tlen; i++)
+        if (best == NULL || tri_slot(text + i)->n < best->n)
+            best = tri_slot(text + i);
+    for (uint32_t i = 0; i < best->n; i++)
+        if (strstr(hist_line(recs[best->ids[i]]), text))
+            printf("%s\n", hist_line(recs[best->ids[i]]));
+}
+
+/**
+ * @brief builtin history, show the lines entered
+ * history          the last lines of every session (MPSH_HISTSIZE, default 1000)
+ * history N        the last N
+ * history -s TEXT  every line of the history file holding TEXT
+ * @param ctx arguments (including program) and context.
+ * @return Always returns 1, to continue execution.
+ */
+int mpsh_history(builtin_ctx_t *ctx) {
+    char **args = ctx->argv;
+    unsigned long from;
+
+    hist_tail();
+    from = ring_first;
+    if (args[1] && !strcmp(args[1], "-s") && args[2]) {
+        hist_search(args[2]);
+        return 1;
+    }
+    if (args[1] && atoi(args[1]) > 0 && atoi(args[1]) < ring_n) {
+        from = ring_first + ring_n - atoi(args[1]);
+    } else if (args[1] && atoi(args[1]) <= 0) {
+        printf("usage: history [N | -s text]\n");
+        last_status = 2;
+        return 1;
+    }
+    for (unsigned long i = from; i < ring_first + ring_n; i++)
+        printf("%5lu  %s\n", i, hist_line(hist_nth(i)));
+    return 1;
+}
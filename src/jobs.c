@@ -0,0 +1,278 @@
+/*
+ * jobs - the job list
+ * a job is one process group: a command or a whole pipeline,
+ * found by JID through a table indexed by JID and by the
+ * PID of any of its processes through an open addressing
+ * hash table, freed JIDs are kept on a free list for reuse
+ *
+ * @author Monthon Paul
+ * @version March 11, 2024
+ */
+#include "mpsh.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+joblist_t jobs; /* The job list */
+
+/***********************************************
+ * Helper routines that manipulate the job list
+ **********************************************/
+
+/* xrealloc - realloc or die */
+static void *xrealloc(void *p, size_t size) {
+    if ((p = realloc(p, size)) == NULL) {
+        fprintf(stderr, "mpsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+/* pidslot - Slot of the PID table holding pid, or the free slot for it */
+static pident_t *pidslot(joblist_t *jl, pid_t pid) {
+    size_t i = ((size_t)pid * 2654435761u) & (jl->pidcap - 1);
+    while (jl->bypid[i].job && jl->bypid[i].pid != pid)
+        i = (i + 1) & (jl->pidcap - 1);
+    return &jl->bypid[i];
+}
+
+/* pidgrow - Double the PID table, rehashing every process */
+static void pidgrow(joblist_t *jl) {
+    pident_t *old = jl->bypid;
+    size_t oldcap = jl->pidcap;
+
+    jl->pidcap = oldcap ? oldcap * 2 : MPSH_JOBS_INIT;
+    jl->bypid = calloc(jl->pidcap, sizeof(pident_t));
+    if (!jl->bypid) {
+        fprintf(stderr, "mpsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < oldcap; i++)
+        if (old[i].job)
+            *pidslot(jl, old[i].pid) = old[i];
+    free(old);
+}
+
+/* pidadd - Map pid to its job in the PID table */
+static void pidadd(joblist_t *jl, pid_t pid, job_t *job) {
+    if ((jl->npids + 1) * 4 > jl->pidcap * 3)
+        pidgrow(jl);
+    pident_t *slot = pidslot(jl, pid);
+    slot->pid = pid;
+    slot->job = job;
+    jl->npids++;
+}
+
+/* pidremove - Take a PID out of the PID table, keeping probe chains intact */
+static void pidremove(joblist_t *jl, pid_t pid) {
+    pident_t *slot = pidslot(jl, pid);
+    if (!slot->job)
+        return;
+    slot->job = NULL;
+    jl->npids--;
+    size_t i = (slot - jl->bypid + 1) & (jl->pidcap - 1);
+    while (jl->bypid[i].job) {
+        pident_t moved = jl->bypid[i];
+        jl->bypid[i].job = NULL;
+        *pidslot(jl, moved.pid) = moved;
+        i = (i + 1) & (jl->pidcap - 1);
+    }
+}
+
+/* clearjob - Clear the entries in a job struct */
+void clearjob(job_t *job) {
+    job->pid = 0;
+    job->jid = 0;
+    job->state = UNDEF;
+    free(job->cmdline);
+    job->cmdline = NULL;
+    free(job->place);
+    job->place = NULL;
+    limit_release(job);
+    free(job->procs);
+    job->procs = NULL;
+    job->nprocs = job->nalive = 0;
+}
+
+/* initjobs - Initialize the job list */
+void initjobs(joblist_t *jl) {
+    memset(jl, 0, sizeof(joblist_t));
+    jl->nextjid = 1;
+    pidgrow(jl);
+}
+
+/* newjid - Take a JID off the free list, or the next unused one */
+static int newjid(joblist_t *jl) {
+    if (jl->nfree)
+        return jl->freejids[--jl->nfree];
+    if (jl->nextjid >= jl->jidcap) {
+        int cap = jl->jidcap ? jl->jidcap * 2 : MPSH_JOBS_INIT;
+        jl->byjid = xrealloc(jl->byjid, cap * sizeof(job_t *));
+        memset(jl->byjid + jl->jidcap, 0, (cap - jl->jidcap) * sizeof(job_t *));
+        jl->jidcap = cap;
+    }
+    return jl->nextjid++;
+}
+
+/* addjob - Add a job led by process pid (its process group) to the job list */
+job_t *addjob(joblist_t *jl, pid_t pid, int state, char *cmdline) {
+    if (pid < 1)
+        return NULL;
+
+    job_t *job = calloc(1, sizeof(job_t));
+    if (!job || !(job->cmdline = strdup(cmdline))) {
+        fprintf(stderr, "mpsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    job->pid = pid;
+    job->state = state;
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    job->jid = newjid(jl);
+    jl->byjid[job->jid] = job;
+    jl->njobs++;
+    addproc(jl, job, pid);
+    return job;
+}
+
+/* addproc - Add another process (pipeline stage) to a job */
+void addproc(joblist_t *jl, job_t *job, pid_t pid) {
+    if (job->nprocs == job->proccap) {
+        job->proccap = job->proccap ? job->proccap * 2 : 4;
+        job->procs = xrealloc(job->procs, job->proccap * sizeof(proc_t));
+    }
+    proc_t *proc = &job->procs[job->nprocs++];
+    proc->pid = pid;
+    proc->state = P_RUNNING;
+    proc->status = 0;
+    proc->tstart = trace_now();
+    job->nalive++;
+    pidadd(jl, pid, job);
+}
+
+/* getproc - Find the process of a job with PID=pid */
+proc_t *getproc(job_t *job, pid_t pid) {
+    for (int i = 0; i < job->nprocs; i++)
+        if (job->procs[i].pid == pid)
+            return &job->procs[i];
+    return NULL;
+}
+
+/*
+ * reapproc - A process of a job is done: take its PID out of the PID
+ *     table, as the kernel may hand it to a process of a later job.
+ *     The leader's stays until deletejob, it names the job, and the
+ *     kernel won't reuse it while it is the process group's ID.
+ */
+void reapproc(joblist_t *jl, job_t *job, proc_t *proc) {
+    proc->state = P_DONE;
+    if (proc->pid != job->pid)
+        pidremove(jl, proc->pid);
+}
+
+/* deletejob - Delete the job that process PID=pid belongs to from the job list */
+int deletejob(joblist_t *jl, pid_t pid) {
+    job_t *job = getjobpid(jl, pid);
+    if (job == NULL)
+        return 0;
+
+    // reaped ones are gone already, their PIDs may be another job's by now
+    for (int i = 0; i < job->nprocs; i++)
+        if (job->procs[i].state != P_DONE || job->procs[i].pid == job->pid)
+            pidremove(jl, job->procs[i].pid);
+    jl->byjid[job->jid] = NULL;
+    if (jl->nfree == jl->freecap) {
+        jl->freecap = jl->freecap ? jl->freecap * 2 : MPSH_JOBS_INIT;
+        jl->freejids = xrealloc(jl->freejids, jl->freecap * sizeof(int));
+    }
+    jl->freejids[jl->nfree++] = job->jid;
+    if (jl->fg == job)
+        jl->fg = NULL;
+    // start numbering from 1 again once the list is empty
+    if (--jl->njobs == 0) {
+        jl->nfree = 0;
+        jl->nextjid = 1;
+    }
+    clearjob(job);
+    free(job);
+    return 1;
+}
+
+/* contjob - Continue a stopped job in the given state (FG or BG) */
+void contjob(job_t *job, int state) {
+    trace_mark("continue", job->pid, job->jid, state == FG ? "fg" : "bg");
+    job->state = state;
+    for (int i = 0; i < job->nprocs; i++)
+        if (job->procs[i].state == P_STOPPED)
+            job->procs[i].state = P_RUNNING;
+    kill(-(job->pid), SIGCONT);
+}
+
+/* jobstatus - Exit status of a finished job, the one of its last stage */
+int jobstatus(job_t *job) {
+    int status = job->procs[job->nprocs - 1].status;
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return WEXITSTATUS(status);
+}
+
+/* getjobpid - Find a job (by the PID of any of its processes) on the job list */
+job_t *getjobpid(joblist_t *jl, pid_t pid) {
+    if (pid < 1)
+        return NULL;
+    return pidslot(jl, pid)->job;
+}
+
+/* getjobjid - Find a job (by JID) on the job list */
+job_t *getjobjid(joblist_t *jl, int jid) {
+    if (jid < 1 || jid >= jl->nextjid)
+        return NULL;
+    return jl->byjid[jid];
+}
+
+/* pid2jid - Map process ID to job ID */
+int pid2jid(pid_t pid) {
+    job_t *job = getjobpid(&jobs, pid);
+    return job ? job->jid : 0;
+}
+
+/* listjobs - Print the job list */
+int listjobs(joblist_t *jl) {
+    for (int i = 1; i < jl->nextjid; i++) {
+        job_t *job = jl->byjid[i];
+        if (job != NULL) {
+            struct rusage ru;
+            printf("[%d] (%d) ", job->jid, job->pid);
+            switch (job->state) {
+                case BG:
+                    printf("Running    ");
+                    break;
+                case FG:
+                    printf("Foreground ");
+                    break;
+                case ST:
+                    printf("Stopped    ");
+                    break;
+                default:
+                    printf("listjobs: Internal error: job[%d].state=%d ", i, job->state);
+            }
+            // wall clock, CPU and largest process so far
+            usage_live(job, &ru);
+            limit_live(job, &ru);
+            printf("%8.1fs %8.2fs %8ldK  ", elapsed(&job->start),
+                   ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+                       (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6,
+                   ru.ru_maxrss);
+            if (job->place)
+                printf("on %s ", job->place);
+            if (job->limit)
+                printf("limit %s ", job->limit);
+            printf("%s", job->cmdline);
+        }
+    }
+    return 1;
+}
+
+/******************************
+ * end job list helper routines
+ ******************************/
@@ -0,0 +1,397 @@
+/*
+ * limit - resource limits for the processes of a job
+ * `limit mem=SIZE cpumax=PCT as=SIZE cpu=SECS nofile=N nproc=N cmd | ...`
+ * puts the pipeline in a cgroup v2 of its own, when the shell can make
+ * one, with memory.max and cpu.max for the job as a whole, and sets the
+ * rlimits of each of its processes in the child before exec. Without
+ * the memory controller mem= becomes an address space rlimit instead.
+ * jobs reads what a job uses from its cgroup, all its processes counted
+ *
+ * @author Monthon Paul
+ * @version March 11, 2024
+ */
+#include "mpsh.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static const limit_t nolimit = {-1, -1, -1, -1, -1, -1};
+limit_t limitcfg = {-1, -1, -1, -1, -1, -1}; /* what new jobs get */
+
+static const struct {
+    char *name;
+    int resource; /* -1 for those of the cgroup */
+    int size;     /* takes K, M, G */
+} limits[] = {
+    {"mem", -1, 1},         {"cpumax", -1, 0},         {"as", RLIMIT_AS, 1},
+    {"cpu", RLIMIT_CPU, 0}, {"nofile", RLIMIT_NOFILE, 0}, {"nproc", RLIMIT_NPROC, 0},
+};
+
+static char cgbase[PATH_MAX]; /* the shell's cgroup for its jobs, empty if none */
+static int cgtried, cgjobs;   /* looked for it, jobs made in it */
+static pid_t cgowner;         /* the shell, not one of its forks */
+
+/* limit_value - Where setting k is kept in l */
+static long long *limit_value(limit_t *l, int k) {
+    long long *v[] = {&l->mem, &l->cpumax, &l->as, &l->cpu, &l->nofile, &l->nproc};
+    return v[k];
+}
+
+/* cg_write - Write s to the file name of cgroup dir; -1 if it can't */
+static int cg_write(const char *dir, const char *name, const char *s) {
+    char path[PATH_MAX + 32];
+    int fd, n;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if ((fd = open(path, O_WRONLY | O_CLOEXEC)) == -1)
+        return -1;
+    n = write(fd, s, strlen(s));
+    close(fd);
+    return n == strlen(s) ? 0 : -1;
+}
+
+/* cg_read - Read the file name of cgroup dir into buf; -1 if it can't */
+static int cg_read(const char *dir, const char *name, char *buf, size_t size) {
+    char path[PATH_MAX + 32];
+    ssize_t n;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+        return -1;
+    n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0)
+        return -1;
+    buf[n] = '\0';
+    return 0;
+}
+
+/* cg_field - The number after key in a cgroup file such as cpu.stat, -1 if none */
+static long long cg_field(const char *dir, const char *name, const char *key) {
+    char buf[4096], *s = buf;
+    size_t len = strlen(key);
+
+    if (cg_read(dir, name, buf, sizeof(buf)) == -1)
+        return -1;
+    for (; s && *s; s = strchr(s, '\n') ? strchr(s, '\n') + 1 : NULL)
+        if (!strncmp(s, key, len) && s[len] == ' ')
+            return atoll(s + len + 1);
+    return -1;
+}
+
+/* cg_has - Whether a cgroup lists controller name in cgroup.controllers */
+static int cg_has(const char *dir, const char *name) {
+    char buf[256];
+    size_t len = strlen(name);
+
+    if (cg_read(dir, "cgroup.controllers", buf, sizeof(buf)) == -1)
+        return 0;
+    for (char *s = buf; (s = strstr(s, name)) != NULL; s += len)
+        if ((s == buf || s[-1] == ' ') && (s[len] == ' ' || s[len] == '\n' || !s[len]))
+            return 1;
+    return 0;
+}
+
+/* cg_cleanup - Remove the shell's cgroups at exit, those that are empty */
+static void cg_cleanup(void) {
+    char dir[PATH_MAX + 32];
+
+    if (getpid() != cgowner)
+        return;
+    for (int i = 1; i <= cgjobs; i++) {
+        snprintf(dir, sizeof(dir), "%s/job%d", cgbase, i);
+        rmdir(dir);
+    }
+    rmdir(cgbase);
+}
+
+/* cg_init - Make the shell's cgroup for its jobs, under its own, once */
+static void cg_init(void) {
+    char line[PATH_MAX * 2], mnt[PATH_MAX] = "", own[PATH_MAX] = "", parent[PATH_MAX * 3];
+    FILE *f;
+
+    if (cgtried++)
+        return;
+    // where cgroup v2 is mounted, and the shell's place in it
+    if ((f = fopen("/proc/self/mountinfo", "re")) != NULL) {
+        while (!*mnt && fgets(line, sizeof(line), f))
+            if (strstr(line, " - cgroup2 "))
+                sscanf(line, "%*d %*d %*s %*s %4095s", mnt);
+        fclose(f);
+    }
+    if ((f = fopen("/proc/self/cgroup", "re")) != NULL) {
+        while (!*own && fgets(line, sizeof(line), f))
+            if (!strncmp(line, "0::", 3))
+                sscanf(line + 3, "%4095s", own);
+        fclose(f);
+    }
+    if (!*mnt || !*own)
+        return;
+    snprintf(parent, sizeof(parent), "%s%s", mnt, strcmp(own, "/") ? own : "");
+    if (snprintf(cgbase, sizeof(cgbase), "%s/mpsh.%d", parent, getpid()) >= sizeof(cgbase) ||
+        (mkdir(cgbase, 0755) == -1 && errno != EEXIST)) {
+        *cgbase = '\0';
+        return;
+    }
+    // hand the controllers down as far as we may, each on its own
+    cg_write(parent, "cgroup.subtree_control", "+memory");
+    cg_write(parent, "cgroup.subtree_control", "+cpu");
+    cg_write(cgbase, "cgroup.subtree_control", "+memory");
+    cg_write(cgbase, "cgroup.subtree_control", "+cpu");
+    cgowner = getpid();
+    atexit(cg_cleanup);
+}
+
+/* limit_size - Parse a number with an optional K, M or G suffix; -1 if it is wrong */
+static long long limit_size(const char *v, int size) {
+    char *end;
+    long long n = strtoll(v, &end, 10);
+
+    if (end == v || n < 0)
+        return -1;
+    if (size && *end && !end[1] && strchr("kKmMgG", *end))
+        n <<= (*end == 'k' || *end == 'K') ? 10 : (*end == 'm' || *end == 'M') ? 20 : 30;
+    else if (*end)
+        return -1;
+    return n;
+}
+
+/**
+ * @brief Parse the settings of limit: mem=SIZE, cpumax=PCT, as=SIZE,
+ * cpu=SECS, nofile=N, nproc=N, at least one of them.
+ * @param args the limit command
+ * @param l receives the settings
+ * @return index of the first word after them, or -1 if they are wrong
+ */
+int limit_parse(char **args, limit_t *l) {
+    int i = 1, n = sizeof(limits) / sizeof(limits[0]), k;
+    char *v;
+
+    *l = nolimit;
+    for (; args[i] && (v = strchr(args[i], '=')) != NULL; i++) {
+        for (k = 0; k < n; k++)
+            if (strlen(limits[k].name) == v - args[i] && !strncmp(args[i], limits[k].name, v - args[i]))
+                break;
+        if (k == n || (*limit_value(l, k) = limit_size(v + 1, limits[k].size)) == -1)
+            return -1;
+        if (limits[k].resource == -1 && *limit_value(l, k) == 0)
+            return -1;  // mem=0 or cpumax=0 could never run
+    }
+    return i > 1 ? i : -1;
+}
+
+/**
+ * @brief The limits a pipeline starts with: a cgroup of its own when the
+ * shell can make one, and rlimits for what that cgroup can't hold.
+ * @param cfg the settings
+ * @param out receives the limits to apply
+ * @return out, or NULL if there are none
+ */
+limit_t *limit_resolve(limit_t *cfg, limit_t *out) {
+    char dir[PATH_MAX], val[64];
+    int n = sizeof(limits) / sizeof(limits[0]), any = 0, made = 0, memheld = 0, cpuheld = 0;
+    static int warned;
+
+    *out = *cfg;
+    for (int k = 0; k < n; k++)
+        any |= *limit_value(out, k) != -1;
+    if (!any)
+        return NULL;
+
+    cg_init();
+    // a cgroup left busy by an earlier job keeps its name
+    while (*cgbase && !made && snprintf(dir, sizeof(dir), "%s/job%d", cgbase, ++cgjobs) < sizeof(dir)) {
+        if ((made = (mkdir(dir, 0755) == 0)) == 0 && errno != EEXIST)
+            break;
+    }
+    if (made) {
+        strcpy(out->cgroup, dir);
+        if (out->mem != -1 && cg_has(dir, "memory")) {
+            snprintf(val, sizeof(val), "%lld", out->mem);
+            memheld = (cg_write(dir, "memory.max", val) == 0);
+        }
+        if (out->cpumax != -1 && cg_has(dir, "cpu")) {
+            snprintf(val, sizeof(val), "%lld 100000", out->cpumax * 1000);
+            cpuheld = (cg_write(dir, "cpu.max", val) == 0);
+        }
+    }
+    // what no cgroup holds: mem= caps the address space of each process instead
+    if (out->mem != -1 && !memheld && (out->as == -1 || out->mem < out->as))
+        out->as = out->mem;
+    if (out->cpumax != -1 && !cpuheld && !warned++)
+        fprintf(stderr, "mpsh: limit: cpumax needs the cpu controller of cgroup v2, not limited\n");
+    return out;
+}
+
+/**
+ * @brief Put the calling process, a child about to exec, in its job's
+ * cgroup and under its rlimits.
+ * @param l the limits, NULL for none
+ * @return 0, or -1 if one could not be applied (and was reported)
+ */
+int limit_apply(limit_t *l) {
+    int n = sizeof(limits) / sizeof(limits[0]);
+
+    if (l == NULL)
+        return 0;
+    if (*l->cgroup && cg_write(l->cgroup, "cgroup.procs", "0") == -1) {
+        perror("mpsh: limit: cgroup");
+        return -1;
+    }
+    for (int k = 0; k < n; k++) {
+        long long v = *limit_value(l, k);
+        // cpu: SIGXCPU at the limit, SIGKILL a second later
+        struct rlimit rl = {v, limits[k].resource == RLIMIT_CPU ? v + 1 : v};
+        if (limits[k].resource == -1 || v == -1)
+            continue;
+        if (setrlimit(limits[k].resource, &rl) == -1) {
+            fprintf(stderr, "mpsh: limit: %s: %s\n", limits[k].name, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Write settings the way limit takes them, e.g. mem=1048576 nofile=64.
+ * @param l the settings
+ * @param buf receives the text, empty for none
+ * @param size size of buf
+ * @return buf
+ */
+char *limit_str(limit_t *l, char *buf, size_t size) {
+    int n = sizeof(limits) / sizeof(limits[0]);
+    size_t len = 0;
+
+    buf[0] = '\0';
+    for (int k = 0; k < n && len < size; k++) {
+        long long v = *limit_value(l, k);
+        if (v != -1)
+            len += snprintf(buf + len, size - len, "%s%s=%lld", len ? " " : "", limits[k].name, v);
+    }
+    return buf;
+}
+
+/**
+ * @brief Keep the limits and cgroup of a job, for listjobs and to
+ * remove the cgroup with it.
+ * @param job the job, NULL if it could not be added
+ * @param l its limits, NULL for none
+ */
+void limit_job(job_t *job, limit_t *l) {
+    char buf[256];
+
+    if (job == NULL || l == NULL)
+        return;
+    job->limit = strdup(limit_str(l, buf, sizeof(buf)));
+    job->cgroup = *l->cgroup ? strdup(l->cgroup) : NULL;
+    if (job->limit == NULL || (*l->cgroup && job->cgroup == NULL)) {
+        fprintf(stderr, "mpsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    l->taken = 1;  // removed with the job
+}
+
+/**
+ * @brief Remove the cgroup of a pipeline that started no job.
+ * @param l its limits
+ */
+void limit_done(limit_t *l) {
+    if (*l->cgroup && !l->taken)
+        rmdir(l->cgroup);
+}
+
+/**
+ * @brief Remove the cgroup of a job that is gone; one still busy
+ * (a process that left the job behind) is removed at exit if it can be.
+ * @param job the job
+ */
+void limit_release(job_t *job) {
+    if (job->cgroup)
+        rmdir(job->cgroup);
+    free(job->cgroup);
+    free(job->limit);
+    job->cgroup = job->limit = NULL;
+}
+
+/**
+ * @brief What a job used so far, from its cgroup: CPU time of all its
+ * processes, and its memory (the peak, where the kernel keeps one).
+ * @param job the job
+ * @param ru receives it over what usage_live found, if the job has a cgroup
+ */
+void limit_live(job_t *job, struct rusage *ru) {
+    long long v;
+
+    if (job->cgroup == NULL)
+        return;
+    if ((v = cg_field(job->cgroup, "cpu.stat", "user_usec")) >= 0)
+        ru->ru_utime = (struct timeval){v / 1000000, v % 1000000};
+    if ((v = cg_field(job->cgroup, "cpu.stat", "system_usec")) >= 0)
+        ru->ru_stime = (struct timeval){v / 1000000, v % 1000000};
+    char buf[64];
+    if (cg_read(job->cgroup, "memory.peak", buf, sizeof(buf)) == 0 ||
+        cg_read(job->cgroup, "memory.current", buf, sizeof(buf)) == 0)
+        ru->ru_maxrss = atoll(buf) / 1024;
+}
+
+/**
+ * @brief Why a process of a job was killed, if it was its limits.
+ * @param job the job
+ * @param sig the signal it died of
+ * @return " (memory limit)", " (cpu limit)" or ""
+ */
+const char *limit_why(job_t *job, int sig) {
+    char *cpu;
+
+    if (job->limit == NULL)
+        return "";
+    if (sig == SIGKILL && job->cgroup && cg_field(job->cgroup, "memory.events", "oom_kill") > 0)
+        return " (memory limit)";
+    if (sig == SIGXCPU)
+        return " (cpu limit)";
+    // SIGKILL follows SIGXCPU only once the limit is used up, a kill -9 before is not it
+    cpu = strstr(job->limit, "cpu=");
+    if (sig == SIGKILL && cpu && (cpu == job->limit || cpu[-1] == ' ') &&
+        job->ru.ru_utime.tv_sec + job->ru.ru_stime.tv_sec +
+                (job->ru.ru_utime.tv_usec + job->ru.ru_stime.tv_usec) / 1e6 >= atoll(cpu + 4))
+        return " (cpu limit)";
+    return "";
+}
+
+/**
+ * @brief builtin limit, show or set the resource limits of jobs
+ * limit                     print the limits later jobs get
+ * limit SETTINGS            make them the default
+ * limit default             back to no limits
+ * limit SETTINGS cmd | ...  only for this pipeline (see mpsh_execute)
+ * SETTINGS are mem=SIZE and cpumax=PCT for the job's cgroup, as=SIZE,
+ * cpu=SECS, nofile=N and nproc=N for each process; SIZE takes K, M, G
+ * @param ctx arguments (including program) and context.
+ * @return Always returns 1, to continue execution.
+ */
+int mpsh_limit(builtin_ctx_t *ctx) {
+    char buf[256];
+    limit_t l;
+
+    if (ctx->argc == 1) {
+        limit_str(&limitcfg, buf, sizeof(buf));
+        printf("%s\n", *buf ? buf : "default");
+        return 1;
+    }
+    if (ctx->argc == 2 && !strcmp(ctx->argv[1], "default")) {
+        limitcfg = nolimit;
+        return 1;
+    }
+    if (limit_parse(ctx->argv, &l) != ctx->argc) {
+        printf("usage: limit [mem=SIZE] [cpumax=PCT] [as=SIZE] [cpu=SECS] [nofile=N] "
+               "[nproc=N] [command]\n");
+        last_status = 2;
+        return 1;
+    }
+    limitcfg = l;
+    return 1;
+}
@@ -13,11 +13,67 @@
 #include <string.h>
 
 /* Global variables */
-static IO files;
-static unsigned short piping, history;
-static int *bg;
-static char concat[MPSH_CMDS];
-int nextjid = 1; /* next job ID to allocate */
+static int interactive; /* stdin is a terminal we hand to fg jobs */
+static int batch;       /* running -c or a script: no prompt, no history */
+static int errexit;     /* -e: stop at the first failing command */
+static arena_t arena;   /* owns everything parsed from the current line */
+static arena_t scratch; /* the expanded commands of the pipeline running */
+int last_status;        /* exit status of the last command */
+
+/* List of builtin commands, one entry each */
+static builtin_t builtins[] = {
+    {"help", &mpsh_help},
+    {"quit", &mpsh_exit},
+    {"cd", &mpsh_cd},
+    {"history", &mpsh_history},
+    {"hash", &mpsh_hash},
+    {"launch", &mpsh_launch_mode},
+    {"jobs", &mpsh_jobs},
+    {"fg", &mpsh_fgbg},
+    {"bg", &mpsh_fgbg},
+    {"echo", &mpsh_echo},
+    {"printf", &mpsh_printf},
+    {"true", &mpsh_true},
+    {"false", &mpsh_false},
+    {"test", &mpsh_test},
+    {"[", &mpsh_test},
+    {"pwd", &mpsh_pwd},
+    {"pipesize", &mpsh_pipesize},
+    {"times", &mpsh_times},
+    {"trace", &mpsh_trace},
+    {"parallel", &mpsh_parallel},
+    {"wait", &mpsh_wait},
+    {"on", &mpsh_on},
+    {"limit", &mpsh_limit},
+    {"cached", &mpsh_cached}};
+
+static builtin_t **builtin_slots; /* perfect hash of builtins, NULL for a linear scan */
+static unsigned builtin_seed, builtin_mask;
+
+#ifndef MPSH_NO_MAIN /* the benchmark harness links the shell with its own main */
+
+static pid_t shell_pid; /* the shell, whose atexit handlers report */
+
+/*
+ * arena_stats - report arena usage on exit when MPSH_ARENA_STATS is set
+ */
+static void arena_stats(void) {
+    if (getpid() != shell_pid)
+        return;  // a child that failed to exec
+    fprintf(stderr, "mpsh: arena %zu allocations, %zu system blocks\n",
+            arena.nalloc, arena.nsys);
+}
+
+/*
+ * usage_exit - print what the session's jobs used on exit when MPSH_USAGE is set
+ */
+static void usage_exit(void) {
+    if (getpid() != shell_pid)
+        return;
+    fflush(stdout);
+    fprintf(stderr, "mpsh: ");
+    usage_summary(stderr);
+}
 
 /**
  * @brief Main entry point.
@@ -26,192 +82,422 @@ int nextjid = 1; /* next job ID to allocate */
  * @return status code
  */
 int main(int argc, char **argv) {
-    /* Install the signal handlers */
+    char *command = NULL, *trace = getenv("MPSH_TRACE");
+    int opt;
+
+    // the launch pool helper is this binary too
+    if (argc == 3 && !strcmp(argv[1], "--pool"))
+        return pool_helper(atoi(argv[2]));
+    while ((opt = getopt(argc, argv, "+c:et:")) != -1) {
+        switch (opt) {
+            case 'c':
+                command = optarg;
+                break;
+            case 'e':
+                errexit = 1;
+                break;
+            case 't':
+                trace = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-e] [-t tracefile] [-c command | script]\n", argv[0]);
+                exit(2);
+        }
+    }
 
-    Signal(SIGINT, sigint_handler);   /* ctrl-c */
-    Signal(SIGTSTP, sigtstp_handler); /* ctrl-z */
-    Signal(SIGCHLD, sigchld_handler); /* Terminated or stopped child */
+    /* timeline of the session, written out at exit */
+    if (trace && *trace)
+        trace_start(trace);
+
+    /* ctrl-c, ctrl-z and child events come in through the event loop */
+    ev_init();
+    Signal(SIGTTOU, SIG_IGN); /* take the terminal back from jobs */
+
+    if (command) {
+        batch = 1;
+        ev_input_string(command);
+    } else if (optind < argc) {
+        int fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            fprintf(stderr, "mpsh: %s: %s\n", argv[optind], strerror(errno));
+            exit(127);
+        }
+        batch = 1;
+        ev_input_fd(fd);
+    } else {
+        interactive = isatty(STDIN_FILENO);
+        ev_input_fd(STDIN_FILENO);
+    }
+    builtin_init();
+    if (getenv("MPSH_LAUNCH")) {
+        char *launch[] = {"launch", getenv("MPSH_LAUNCH"), NULL};
+        mpsh_launch_mode(&(builtin_ctx_t){.argv = launch, .argc = 2, .jobs = &jobs});
+    }
+
+    /* lines entered, kept across sessions when interactive */
+    if (!batch) {
+        char *file = getenv("MPSH_HISTFILE"), path[PATH_MAX];
+        if (!file && interactive && getenv("HOME")) {
+            snprintf(path, sizeof(path), "%s/.mpsh_history", getenv("HOME"));
+            file = path;
+        }
+        hist_init(file && *file ? file : NULL);
+    }
 
     /* Initialize the job list */
-    initjobs(jobs);
+    initjobs(&jobs);
+
+    shell_pid = getpid();
+    if (getenv("MPSH_ARENA_STATS"))
+        atexit(arena_stats);
+    if (getenv("MPSH_USAGE"))
+        atexit(usage_exit);
 
     // Run command loop.
     mpsh_loop();
-    return 0;
+    return last_status;
 }
+#endif
 
 /**
  * @brief Loop getting input and executing it.
  */
 void mpsh_loop() {
     char *line;
-    char ***args;
+    list_t *list;
     int status;
-    char *cmds[MPSH_CMDS] = {NULL};
-    history = 0;
+    unsigned long long t;
 
     do {
-        printf("mpsh$ ");
-        line = mpsh_read_line();
-        if (strcmp(line, "\n"))
-            cmds[history++] = strdup(line);
-        args = mpsh_split_line(line);
-        status = mpsh_execute(args, cmds);
-
-        for (int i = 0; i < MPSH_TOK_BUFSIZE; i++)
-            free(args[i]);
-        free(files.input);
-        free(files.output);
-        free(line);
-        free(args);
-        free(bg);
+        if (!batch)
+            printf("mpsh$ ");
+        t = trace_now();
+        if ((line = mpsh_read_line()) == NULL)
+            break;  // end of input
+        trace_span("read", t, 0, NULL);
+        if (!batch && *line && (line = hist_enter(line)) == NULL) {
+            status = 1;  // a ! that matched nothing, run nothing
+            continue;
+        }
+        t = trace_now();
+        list = mpsh_parse(line, &arena);
+        trace_span("parse", t, 0, NULL);
+        t = trace_now();
+        if (list) {
+            status = mpsh_execute(list);
+        } else {
+            status = 1;
+            last_status = 2;  // syntax error
+            if (errexit)
+                exit(last_status);
+        }
+        trace_span("line", t, 0, NULL);
+
+        // everything parsed from the line goes in one step
+        arena_reset(&arena);
     } while (status);
 }
 
+/* builtin_hash - seeded FNV-1a hash of a name, reduced to a slot */
+static unsigned builtin_hash(const char *s, unsigned seed) {
+    unsigned h = 2166136261u ^ seed;
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    // the low bits only see the low bits of the seed, fold the high ones in
+    return (h ^ (h >> 16)) & builtin_mask;
+}
+
 /**
- * @brief Read a line of input from stdin.
- * @return The line from stdin.
+ * @brief Build the builtin hash table. Looks for a seed that
+ * puts every builtin in a slot of its own, so a lookup is
+ * one hash and one compare. Tries MPSH_BUILTIN_SEEDS seeds, then
+ * twice the slots; if even 16 times as many won't do, lookups scan.
  */
-char *mpsh_read_line() {
-    char *line = NULL;
-    size_t bufsize = 0;  // have getline allocate a buffer for us
+void builtin_init(void) {
+    int n = sizeof(builtins) / sizeof(builtin_t);
 
-    if (getline(&line, &bufsize, stdin) == -1) {
-        if (feof(stdin)) {
-            exit(EXIT_SUCCESS);  // We recieved an EOF
-        } else {
-            perror("mpsh: readline");
+    for (unsigned size = MPSH_BUILTIN_SLOTS; size <= MPSH_BUILTIN_SLOTS << 4; size *= 2) {
+        if ((builtin_slots = calloc(size, sizeof(builtin_t *))) == NULL) {
+            fprintf(stderr, "mpsh: allocation error\n");
             exit(EXIT_FAILURE);
         }
+        builtin_mask = size - 1;
+        for (builtin_seed = 0; builtin_seed < MPSH_BUILTIN_SEEDS; builtin_seed++) {
+            int i;
+            memset(builtin_slots, 0, size * sizeof(builtin_t *));
+            for (i = 0; i < n; i++) {
+                builtin_t **slot = &builtin_slots[builtin_hash(builtins[i].name, builtin_seed)];
+                if (*slot)
+                    break;  // collision, try the next seed
+                *slot = &builtins[i];
+            }
+            if (i == n)
+                return;
+        }
+        free(builtin_slots);
     }
-    return line;
+    builtin_slots = NULL;
 }
+
 /**
- * @brief Split a line into tokens (very naively).
- * @param line The line.
- * @return Null-terminated array of tokens.
+ * @brief Find a builtin command by name.
+ * @param name command name
+ * @return its table entry, or NULL
  */
-char ***mpsh_split_line(char *line) {
-    int bufsize = MPSH_TOK_BUFSIZE, pos = 0, cmdpos = 0;
-    char ***tokens = calloc(bufsize, sizeof(char *));
-    files.input = calloc(bufsize, sizeof(char *));
-    files.output = calloc(bufsize, sizeof(char *));
-    bg = malloc(bufsize * sizeof(int));
-    for (int i = 0; i < bufsize; i++)
-        tokens[i] = calloc(bufsize, sizeof(char *));
-    char *token, **tokens_backup;
-    piping = 0;
-
-    if (!tokens) {
-        fprintf(stderr, "mpsh: allocation error\n");
-        exit(EXIT_FAILURE);
+builtin_t *mpsh_find_builtin(char *name) {
+    builtin_t *b;
+
+    if (builtin_slots == NULL) {
+        for (int i = 0; i < sizeof(builtins) / sizeof(builtin_t); i++)
+            if (!strcmp(name, builtins[i].name))
+                return &builtins[i];
+        return NULL;
     }
+    b = builtin_slots[builtin_hash(name, builtin_seed)];
+    return (b && !strcmp(name, b->name)) ? b : NULL;
+}
 
-    token = strtok(line, MPSH_TOK_DELIM);
-    while (token != NULL) {
-        if (!strcmp(token, "<")) {
-            token = strtok(NULL, MPSH_TOK_DELIM);
-            files.input[cmdpos] = token;
-        } else if (!strcmp(token, ">")) {
-            token = strtok(NULL, MPSH_TOK_DELIM);
-            files.output[cmdpos] = token;
-        } else if (!strcmp(token, "|")) {
-            tokens[cmdpos][pos] = NULL;
-            pos = 0, piping = 1;
-            token = strtok(NULL, MPSH_TOK_DELIM);
-            tokens[++cmdpos][pos++] = token;
-        } else if (!strcmp(token, ";")) {
-            tokens[cmdpos][pos] = NULL;
-            pos = 0;
-            token = strtok(NULL, MPSH_TOK_DELIM);
-            tokens[++cmdpos][pos++] = token;
-        } else if (!strcmp(token, "&")) {
-            bg[cmdpos] = 1;
-        } else {
-            tokens[cmdpos][pos++] = token;
-        }
+/**
+ * @brief Run a builtin, last_status is 0 unless it says otherwise.
+ * @param b the builtin
+ * @param cmd the command
+ * @param forked running in a pipeline child
+ * @return 1 if the shell should continue running, 0 if it should terminate
+ */
+static int builtin_call(builtin_t *b, cmd_t *cmd, int forked) {
+    builtin_ctx_t ctx = {cmd->argv, cmd->argc, cmd, &jobs, forked};
 
-        if (pos >= bufsize) {
-            bufsize += MPSH_TOK_BUFSIZE;
-            tokens_backup = tokens[cmdpos];
-            tokens[cmdpos] = realloc(tokens, bufsize * sizeof(char *));
-            if (!tokens) {
-                free(tokens_backup);
-                fprintf(stderr, "mpsh: allocation error\n");
-                exit(EXIT_FAILURE);
+    last_status = 0;
+    return b->func(&ctx);
+}
+
+/**
+ * @brief Run a builtin as a pipeline stage, in the forked child.
+ * @param cmd the command (including program and redirections).
+ */
+void mpsh_builtin_child(cmd_t *cmd) {
+    builtin_call(mpsh_find_builtin(*cmd->argv), cmd, 1);
+    fflush(stdout);
+    _exit(last_status);
+}
+
+/* redirect_one - Do one fd action, -1 (reported) if it fails */
+static int redirect_one(fdact_t *a) {
+    int f;
+
+    switch (a->op) {
+        case FD_CLOSE:
+            close(a->fd);
+            return 0;
+        case FD_DUP:
+            if (dup2(a->src, a->fd) == -1) {
+                fprintf(stderr, "mpsh: %d: %s\n", a->src, strerror(errno));
+                return -1;
             }
-        }
+            return 0;
+    }
+    if ((f = open(a->path, a->flags, 0644)) == -1) {
+        fprintf(stderr, "mpsh: %s: %s\n", a->path, strerror(errno));
+        return -1;
+    }
+    if (f != a->fd) {
+        dup2(f, a->fd);
+        close(f);
+    }
+    return 0;
+}
 
-        token = strtok(NULL, MPSH_TOK_DELIM);
+/**
+ * @brief Do the redirections of a builtin in the shell itself,
+ * keeping copies of the descriptors they replace.
+ * @param cmd the command
+ * @param saved receives the saved copy for each action: -1 if its fd
+ *        was closed, -2 if the action wasn't done
+ * @return 0 on success, -1 if one failed (and was reported)
+ */
+int redirect_save(cmd_t *cmd, int *saved) {
+    int ret = 0;
+
+    fflush(stdout);
+    for (int i = 0; i < cmd->nacts; i++) {
+        saved[i] = -2;
+        if (ret == 0) {
+            saved[i] = fcntl(cmd->acts[i].fd, F_DUPFD_CLOEXEC, 10);
+            ret = redirect_one(&cmd->acts[i]);
+        }
     }
-    tokens[cmdpos][pos] = NULL;
-    return tokens;
+    return ret;
 }
+
 /**
- * Get the size of builtin commands
+ * @brief Put back the descriptors saved by redirect_save, last first.
+ * @param cmd the command
+ * @param saved the saved descriptors
  */
-int mpsh_size_builtins() {
-    return sizeof(builtin_str) / sizeof(char *);
+void redirect_restore(cmd_t *cmd, int *saved) {
+    fflush(stdout);
+    for (int i = cmd->nacts - 1; i >= 0; i--) {
+        if (saved[i] == -1) {
+            close(cmd->acts[i].fd);
+        } else if (saved[i] >= 0) {
+            // the shell's own fds above stdio are all close-on-exec
+            dup3(saved[i], cmd->acts[i].fd, cmd->acts[i].fd > STDERR_FILENO ? O_CLOEXEC : 0);
+            close(saved[i]);
+        }
+    }
+}
+
+/* redirect_close - Close the shell's copies of the here-strings of a pipeline */
+static void redirect_close(cmd_t *cmds, int n) {
+    for (int j = 0; j < n; j++)
+        for (int i = 0; i < cmds[j].nacts; i++)
+            if (cmds[j].acts[i].own)
+                close(cmds[j].acts[i].src);
 }
 
 /**
  *  @brief Execute shell built-in or launch program.
- *  @param args Null terminated list of arguments.
+ *  @param cmd the command (not part of a pipeline).
+ *  @param sigs signals to block while launching.
  *  @return 1 if the shell should continue running, 0 if it should terminate
  */
-int mpsh_execute(char ***args, char **cmds) {
-    if (**args == NULL)
-        return 1;  // An empty command was entered.
-
-    // Signal Bockers
-    sigset_t sigs;
-    sigemptyset(&sigs);
-    sigaddset(&sigs, SIGCHLD);
-    sigaddset(&sigs, SIGSTOP);
-    sigaddset(&sigs, SIGINT);
-
-    if (*args[1] && piping)
-        return mpsh_piping(args, sigs);
-    for (int i = 0; i < mpsh_size_builtins(); i++) {
-        if (!strcmp(**args, "jobs"))
-            return listjobs(jobs);
-        else if (!strcmp(**args, "history") && !strcmp(**args, builtin_str[i]))
-            return (*builtin_func[i])(cmds);
-        else if (!strcmp(**args, builtin_str[i]))
-            return (*builtin_func[i])(*args);
-        else if (!strcmp(**args, "bg") || !strcmp(**args, "fg")) {
-            int jid;
-            if ((*args)[1] == NULL) {
-                printf("%s command requires a %%jobid argument\n", **args);
-                return 1;
+static int mpsh_run(cmd_t *cmd, sigset_t sigs) {
+    builtin_t *b = mpsh_find_builtin(*cmd->argv);
+    int saved[cmd->nacts + 1], status;
+    unsigned long long t = trace_now();
+
+    if (b == NULL && mpsh_copy_stage(cmd, 1) == 0) {
+        last_status = mpsh_copy(cmd, -1, -1);  // a cat the shell does itself
+        trace_span("copy", t, 0, *cmd->argv);
+        return 1;
+    }
+    if (b == NULL)
+        return mpsh_launch(cmd, sigs); // launch
+
+    if (cmd->nacts == 0) {
+        status = builtin_call(b, cmd, 0);
+    } else if (redirect_save(cmd, saved) == -1) {
+        redirect_restore(cmd, saved);
+        last_status = 1;
+        return 1;
+    } else {
+        status = builtin_call(b, cmd, 0);
+        redirect_restore(cmd, saved);
+    }
+    trace_span("builtin", t, 0, *cmd->argv);
+    return status;
+}
+
+/**
+ *  @brief Execute every pipeline of a list, in order.
+ *  @param list the parsed line, left as it is so it can run again.
+ *  @return 1 if the shell should continue running, 0 if it should terminate
+ */
+int mpsh_execute(list_t *list) {
+    // blocked in the shell, children unblock them before exec
+    sigset_t sigs = evsigs;
+
+    for (pipeline_t *pl = list->head; pl; pl = pl->next) {
+        cmd_t *cmd = arena_alloc(&scratch, pl->ncmds * sizeof(cmd_t));
+        pipecfg_t cfg = pipecfg;
+        place_t oncfg = placecfg, placed, *place;
+        limit_t limcfg = limitcfg, limited, *limit;
+        usage_mark_t mark;
+        int n = 0, status = 1, k, timed = 0, run = 1, cached = 0, content = 0;
+
+        // words are expanded as the pipeline runs, so globs see what earlier ones made
+        glob_reset();
+        for (simple_t *s = pl->cmds; s && run; s = s->next, n++) {
+            // a redirection that can't be set up fails the whole pipeline
+            run = (mpsh_expand(s, &scratch, &cmd[n]) == 0);
+            cmd[n].piped = (s->next != NULL);
+            cmd[n].bg = pl->bg;
+        }
+        if (!run)
+            last_status = 1;
+
+        // time cmd | ... reports what the pipeline used
+        if (cmd->argc > 1 && !strcmp(*cmd->argv, "time")) {
+            cmd->argv++;
+            cmd->argc--;
+            timed = 1;
+            usage_start(&mark);
+        }
+        // pipesize [-p] N cmd | ... sets the pipes of this pipeline only
+        if (cmd->argc > 2 && !strcmp(*cmd->argv, "pipesize") &&
+            (k = pipe_parse(cmd->argv, &cfg)) > 0 && k < cmd->argc) {
+            cmd->argv += k;
+            cmd->argc -= k;
+        }
+        // on SETTINGS, limit SETTINGS and cached, in any order, for this pipeline only
+        for (k = 1; k > 0 && cmd->argc > 1;) {
+            if (!strcmp(*cmd->argv, "on"))
+                k = place_parse(cmd->argv, &oncfg);
+            else if (!strcmp(*cmd->argv, "limit"))
+                k = limit_parse(cmd->argv, &limcfg);
+            else if (!strcmp(*cmd->argv, "cached") && n == 1 && !pl->bg)
+                cached = (k = cache_parse(cmd->argv, &content)) < cmd->argc;
+            else
+                k = 0;
+            if (k > 0 && k < cmd->argc) {
+                cmd->argv += k;
+                cmd->argc -= k;
+            } else {
+                k = 0;  // the builtin sets the default, or says what's wrong
             }
-            if (*args[0][1] == '%')
-                jid = atoi(&args[0][1][1]);
-            else {
-                printf("%s: argument must be a %%jobid\n", **args);
-                return 1;
+        }
+        // every process of the pipeline gets them, in the child before exec
+        place = run ? place_resolve(&oncfg, pl->bg, &placed) : NULL;
+        limit = run ? limit_resolve(&limcfg, &limited) : NULL;
+        for (int j = 0; j < n; j++) {
+            cmd[j].place = place;
+            cmd[j].limit = limit;
+        }
+        for (int j = 0; j < n && run; j++) {
+            if (cmd[j].argc == 0 && n > 1) {
+                fprintf(stderr, "mpsh: empty command in a pipeline\n");
+                last_status = 1;
+                run = 0;
             }
-            if (!strcmp(**args, "bg"))
-                return mpsh_bg(jid);
-            else
-                return mpsh_fg(jid);
         }
+        if (run && n > 1) {
+            status = mpsh_piping(cmd, n, &cfg, sigs);
+        } else if (run && cached && !mpsh_find_builtin(*cmd->argv)) {
+            status = cache_run(cmd, content, sigs);
+        } else if (run && cmd->argc > 0) {
+            status = mpsh_run(cmd, sigs);
+        } else if (run) {
+            // only redirections: > file makes the file
+            int saved[cmd->nacts + 1];
+            last_status = redirect_save(cmd, saved) == -1;
+            redirect_restore(cmd, saved);
+        }
+        redirect_close(cmd, n);
+        if (limit)
+            limit_done(limit);
+        arena_reset(&scratch);
+        if (timed)
+            usage_report(&mark);
+        if (!status)
+            return 0;
+        if (errexit && last_status)
+            exit(last_status);
     }
-    return mpsh_launch(args, sigs); // launch
+    return 1;
 }
 
 /**
  * Help information about the Shell program
- * @param args list of arguments (including program).
+ * @param ctx arguments (including program) and context.
  * @return 1 if the shell should continue running, 0 if it should terminate
  */
-int mpsh_help(char **args) {
+int mpsh_help(builtin_ctx_t *ctx) {
     printf("Monthon Paul MPSH\n");
     printf("Type program names and arguments, and hit enter.\n");
     printf("The following are built in:\n");
 
-    for (int i = 0; i < mpsh_size_builtins(); i++)
-        printf("  %s\n", builtin_str[i]);
+    for (int i = 0; i < sizeof(builtins) / sizeof(builtin_t); i++)
+        printf("  %s\n", builtins[i].name);
 
     printf("Use the man command for information on other programs.\n");
     return 1;
@@ -219,38 +505,66 @@ int mpsh_help(char **args) {
 
 /**
  * quit out of the Shell program
- * @param args list of arguments (including program).
+ * @param ctx arguments (including program) and context.
  */
-int mpsh_exit(char **args) {
+int mpsh_exit(builtin_ctx_t *ctx) {
     exit(EXIT_SUCCESS);
 }
 
-/**
- * @brief show history of commands enter
- * @param cmds list of commands enter
- * @return Always returns 1, to continue execution.
- */
-int mpsh_history(char **cmds) {
-    for (int i = 0; cmds[i] != NULL; i++)
-        printf("%d %s", i + 1, cmds[i]);
-    return 1;
-}
-
 /**
  * @brief exec change directory
- * @param args list of arguments (including program).
+ * @param ctx arguments (including program) and context.
  * @return Always returns 1, to continue execution.
  */
-int mpsh_cd(char **args) {
+int mpsh_cd(builtin_ctx_t *ctx) {
+    char **args = ctx->argv;
     if (args[1]) {
-        if (chdir(args[1]) == -1)
+        if (chdir(args[1]) == -1) {
             perror("mpsh");
+            last_status = 1;
+        }
     } else {
         printf("expected argument for cd\n");
+        last_status = 1;
     }
     return 1;
 }
 
+/**
+ * @brief builtin jobs, list the jobs
+ * @param ctx arguments (including program) and context.
+ * @return Always returns 1, to continue execution.
+ */
+int mpsh_jobs(builtin_ctx_t *ctx) {
+    return listjobs(ctx->jobs);
+}
+
+/**
+ * @brief builtin fg / bg, check the %jobid argument and continue the job
+ * @param ctx arguments (including program) and context.
+ * @return Always returns 1, to continue execution.
+ */
+int mpsh_fgbg(builtin_ctx_t *ctx) {
+    char **args = ctx->argv;
+    int jid;
+    if (args[1] == NULL) {
+        printf("%s command requires a %%jobid argument\n", *args);
+        last_status = 1;
+        return 1;
+    }
+    if (args[1][0] == '%')
+        jid = atoi(&args[1][1]);
+    else {
+        printf("%s: argument must be a %%jobid\n", *args);
+        last_status = 1;
+        return 1;
+    }
+    if (!strcmp(*args, "bg"))
+        return mpsh_bg(jid);
+    else
+        return mpsh_fg(jid);
+}
+
 /**
  * @brief exec builtin foreground command
  * @param jid takes job id number.
@@ -258,14 +572,14 @@ int mpsh_cd(char **args) {
  */
 int mpsh_bg(int jid) {
     // get background job from jid
-    job_t *bg_job = getjobjid(jobs, jid);
+    job_t *bg_job = getjobjid(&jobs, jid);
     // check if process exist in background in order send SIGCONT signal
     if (bg_job != NULL) {
-        bg_job->state = BG;
-        kill(-(bg_job->pid), SIGCONT);
+        contjob(bg_job, BG);
         printf("[%d] (%d) %s", pid2jid(bg_job->pid), bg_job->pid, bg_job->cmdline);
     } else {
         printf("%%%d: No such job\n", jid);
+        last_status = 1;
     }
     return 1;
 }
@@ -277,193 +591,217 @@ int mpsh_bg(int jid) {
  */
 int mpsh_fg(int jid) {
     // get foreground job from jid
-    job_t *fg_job = getjobjid(jobs, jid);
+    job_t *fg_job = getjobjid(&jobs, jid);
     // check if process exist in foreground in order send SIGCONT signal
     if (fg_job != NULL) {
-        fg_job->state = FG;
-        kill(-(fg_job->pid), SIGCONT);
+        contjob(fg_job, FG);
         waitfg(fg_job->pid);
     } else {
         printf("%%%d: No such job\n", jid);
+        last_status = 1;
     }
     return 1;
 }
 
 /**
  * @brief Launch a program and wait for it to terminate.
- * @param args Null terminated list of arguments (including program).
+ * @param cmd the command (including program and redirections).
  * @return Always returns 1, to continue execution.
  */
-int mpsh_launch(char ***args, sigset_t sigs) {
+int mpsh_launch(cmd_t *cmd, sigset_t sigs) {
     pid_t pid;
+    char **args = cmd->argv, *path;
 
-    /* loop through listing */
-    for (int i = 0; *args[i] != NULL; i++) {
-        sigprocmask(SIG_BLOCK, &sigs, NULL);
-        if ((pid = fork()) == 0) {
-            // need to unblock before exec call
-            sigprocmask(SIG_UNBLOCK, &sigs, NULL);
-
-            mpsh_redirect(i);
-            if (execvp(*args[i], args[i]) == -1) {
-                printf("%s: Command not found\n", *args[i]);
-                exit(EXIT_FAILURE);
-            }
-        }
-        addjob(jobs, pid, (bg[i]) ? BG : FG, concatstr(args[i], bg[i]));
-        sigprocmask(SIG_UNBLOCK, &sigs, NULL);
-
-        /* Parent waits for child to terminate, unless it's background */
-        if (!bg[i])
-            waitfg(pid);
-        else
-            printf("[%d] (%d) %s", pid2jid(pid), pid, concatstr(args[i], bg[i]));
+    unsigned long long t = trace_now();
+
+    // resolve in the parent, no fork for a missing command
+    path = hash_lookup(*args);
+    trace_span("resolve", t, 0, *args);
+    if (path == NULL) {
+        printf("%s: Command not found\n", *args);
+        last_status = 127;
+        return 1;
     }
+
+    if ((pid = mpsh_spawn(cmd, path, -1, -1, 0, sigs)) < 0) {
+        last_status = 127;
+        return 1;
+    }
+    char *cmdline = concatstr(cmd, 1);
+    job_t *job = addjob(&jobs, pid, (cmd->bg) ? BG : FG, cmdline);
+    place_job(job, cmd->place);
+    limit_job(job, cmd->limit);
+
+    /* Parent waits for child to terminate, unless it's background */
+    if (!cmd->bg)
+        waitfg(pid);
+    else
+        printf("[%d] (%d) %s", pid2jid(pid), pid, cmdline);
     return 1;
 }
 
 /**
- * @brief concatnate an array of strings
- * @param str an array of strings
- * @param bg check if it's in the background
- * @return concatnated string with spaces
+ * @brief concatnate the commands of a pipeline
+ * @param cmds the commands, the last one tells if it's in the background
+ * @param n number of commands
+ * @return concatnated string with spaces and pipes, owned by the arena
  */
-char *concatstr(char **str, int bg) {
-    *concat = '\0';
-    for (int i = 0; str[i] != NULL; i++) {
-        strcat(concat, str[i]);
-        if (str[i + 1] != NULL)
-            strcat(concat, " ");
+char *concatstr(cmd_t *cmds, int n) {
+    size_t len = sizeof(" &\n");
+    for (int j = 0; j < n; j++)
+        for (int i = 0; cmds[j].argv[i] != NULL; i++)
+            len += strlen(cmds[j].argv[i]) + 3;
+
+    char *concat = arena_alloc(&arena, len), *p = concat;
+    for (int j = 0; j < n; j++) {
+        char **str = cmds[j].argv;
+        if (j)
+            p = stpcpy(p, " | ");
+        for (int i = 0; str[i] != NULL; i++) {
+            if (i)
+                *p++ = ' ';
+            p = stpcpy(p, str[i]);
+        }
     }
-    if (bg)
-        strcat(concat, " &");
-    return strcat(concat, "\n");  // add newline at end
+    if (cmds[n - 1].bg)
+        p = stpcpy(p, " &");
+    strcpy(p, "\n");  // add newline at end
+    return concat;
 }
 
 /*
- * waitfg - Block until process pid is no longer the foreground process
+ * waitfg - Block until the job of process pid is no longer the foreground job
  */
 void waitfg(pid_t pid) {
-    job_t *fg_job = getjobpid(jobs, pid);
-    // loop around sigsupend so the shell is blocked until fg is not null and still in FG state.
-    while (fg_job != NULL && fg_job->state == FG) {
-        // block signal for a bit and unblock
-        sigset_t empty;
-        sigemptyset(&empty);
-        sigsuspend(&empty);
-    }
+    job_t *fg_job = getjobpid(&jobs, pid);
+    unsigned long long t = trace_now();
+    int jid = fg_job ? fg_job->jid : 0;
+
+    // hand the terminal to the job while it runs in the foreground
+    if (interactive && fg_job != NULL)
+        tcsetpgrp(STDIN_FILENO, fg_job->pid);
+    // handle signals as they come until fg is not null and still in FG state.
+    jobs.fg = fg_job;
+    while (jobs.fg != NULL && jobs.fg->state == FG)
+        ev_signals();
+    jobs.fg = NULL;
+    if (interactive)
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+    trace_span("wait", t, jid, NULL);
 }
 
 /**
- * @brief I/O redirect to a file
- * @param pos I/O position for input file or output file
+ * @brief I/O redirect: do the fd actions of a command, in order
+ * @param cmd command holding them
+ * @return 0, or -1 if one failed (and was reported)
  */
-void mpsh_redirect(int pos) {
-    char *input = files.input[pos], *output = files.output[pos];
-    if (input) {
-        int in = open(input, O_RDONLY);
-        if (in == -1) {
-            perror("mpsh");
-            exit(EXIT_FAILURE);
-        }
-        dup2(in, STDIN_FILENO);
-        close(in);
-    }
-    if (output) {
-        int out = creat(output, 0644);
-        if (out == -1) {
-            perror("mpsh");
-            exit(EXIT_FAILURE);
-        }
-        dup2(out, STDOUT_FILENO);
-        close(out);
-    }
+int mpsh_redirect(cmd_t *cmd) {
+    for (int i = 0; i < cmd->nacts; i++)
+        if (redirect_one(&cmd->acts[i]) == -1)
+            return -1;
+    return 0;
 }
 
 /**
  * @brief the shell Pipline cmd
- * @param args 2D array of strings terminated by NULL
+ * @param cmds the stages of the pipeline
+ * @param size number of stages (at least 2)
+ * @param cfg capacity and mode of the pipes between them
  * @return Always returns 1, to continue execution.
  */
-int mpsh_piping(char ***args, sigset_t sigs) {
-    pid_t pid;
-    int fds[2], size, next_input;
-
-    sigprocmask(SIG_BLOCK, &sigs, NULL);
-    for (size = 0; *args[size] != NULL; size++) {
-    }
-    pipe(fds);
-    if ((pid = fork()) == 0) {  // special case: redirect only to stdout
-        // first child redirects write end to stdout
-        dup2(fds[1], STDOUT_FILENO);
-
-        // close the read & write
-        close(fds[0]);
-        close(fds[1]);
-
-        // need to unblock before exec call
-        sigprocmask(SIG_UNBLOCK, &sigs, NULL);
-
-        // check for I/O redirects
-        mpsh_redirect(0);
-        if (execvp(**args, *args) == -1) {
-            printf("%s: Command not found\n", **args);
-            exit(1);
+int mpsh_piping(cmd_t *cmds, int size, pipecfg_t *cfg, sigset_t sigs) {
+    pid_t pid, pgid;
+    int fds[2], in = -1, shellfd = -1, status;
+    int copy = mpsh_copy_stage(cmds, size);  // stage the shell does itself, or -1
+    char *paths[size];
+
+    // resolve every stage before starting any of them, builtins have no path
+    for (int i = 0; i < size; i++) {
+        unsigned long long t = trace_now();
+        paths[i] = NULL;
+        if (i == copy || mpsh_find_builtin(*cmds[i].argv))
+            continue;
+        paths[i] = hash_lookup(*cmds[i].argv);
+        trace_span("resolve", t, 0, *cmds[i].argv);
+        if (paths[i] == NULL) {
+            printf("%s: Command not found\n", *cmds[i].argv);
+            last_status = 127;
+            return 1;
         }
     }
-    addjob(jobs, pid, FG, concatstr(*args, 0));
-    /* middle pipeline loop */
-    for (int i = 1; i < size - 1; i++) {
-        close(fds[1]);
-        next_input = fds[0];
-        pipe(fds);
-        if ((pid = fork()) == 0) {
-            dup2(next_input, STDIN_FILENO);
-            dup2(fds[1], STDOUT_FILENO);
-            close(fds[0]);
-
-            // need to unblock before exec call
-            sigprocmask(SIG_UNBLOCK, &sigs, NULL);
-
-            // check for I/O redirects
-            mpsh_redirect(i);
-            if (execvp(*args[i], args[i]) == -1) {
-                printf("%s: Command not found\n", *args[i]);
-                exit(1);
+
+    job_t *job = NULL;
+    int bg = cmds[size - 1].bg;
+    for (int i = 0; i < size; i++) {
+        int out = -1, next_input = -1;
+        if (i < size - 1) {
+            // close-on-exec: only the dup2'd copies reach the programs
+            if (mpsh_pipe(fds, cfg, size) == -1) {
+                if (in != -1)
+                    close(in);
+                break;
             }
+            out = fds[1];
+            next_input = fds[0];
         }
-        close(next_input);
-        addjob(jobs, pid, FG, *args[i]);
-    }
-    close(fds[1]);
-    next_input = fds[0];
-    if ((pid = fork()) == 0) {  // special case: redirect only to stdin
-        // first child redirects read end to stdin
-        dup2(next_input, STDIN_FILENO);
-
-        // need to unblock before exec call
-        sigprocmask(SIG_UNBLOCK, &sigs, NULL);
-
-        // check for I/O redirects
-        mpsh_redirect(size - 1);
-        if (execvp(*args[size - 1], args[size - 1]) == -1) {
-            printf("%s: Command not found\n", *args[size - 1]);
-            exit(1);
+        // every stage joins the process group of the first, as one job,
+        // but for a cat done by the shell, which keeps its end of the pipe
+        if (i == copy) {
+            spawn_shellfd = shellfd = i ? in : out;
+            if (i)
+                in = -1;
+            else
+                out = -1;
+        } else if ((pid = mpsh_spawn(&cmds[i], paths[i], in, out, job ? job->pid : 0, sigs)) > 0) {
+            if (job == NULL) {
+                job = addjob(&jobs, pid, bg ? BG : FG, concatstr(cmds, size));
+                place_job(job, cmds[i].place);
+                limit_job(job, cmds[i].limit);
+            } else
+                addproc(&jobs, job, pid);
         }
+        if (in != -1)
+            close(in);
+        if (out != -1)
+            close(out);
+        in = next_input;
+    }
+    spawn_shellfd = -1;
+    if (job == NULL) {
+        if (shellfd != -1)
+            close(shellfd);
+        last_status = 127;
+        return 1;
     }
-    close(next_input);
 
-    // add jobs for both process and Unblock Signal
-    addjob(jobs, pid, FG, concatstr(args[size - 1], 0));
-    sigprocmask(SIG_UNBLOCK, &sigs, NULL);
-    // Parent
-    for (int i = 0; i < size - 1; i++)
-        waitfg(pid);
+    if (copy != -1) {
+        // the shell is the cat stage, as part of the foreground job
+        pgid = job->pid;
+        if (interactive)
+            tcsetpgrp(STDIN_FILENO, pgid);
+        jobs.fg = job;
+        unsigned long long t = trace_now();
+        int jid = job->jid;
+        status = copy ? mpsh_copy(&cmds[copy], shellfd, -1) : mpsh_copy(&cmds[copy], -1, shellfd);
+        trace_span("copy", t, jid, "cat");
+        waitfg(pgid);
+        if (copy == size - 1)
+            last_status = status;
+        return 1;
+    }
+
+    /* Parent waits for every stage, unless it's background */
+    if (!bg)
+        waitfg(job->pid);
+    else
+        printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
     return 1;
 }
 
 /*****************
  * Signal handlers
+ * (run from the event loop when the signalfd reports the signal,
+ *  never from signal context)
  *****************/
 
 /*
@@ -476,17 +814,48 @@ int mpsh_piping(char ***args, sigset_t sigs) {
 void sigchld_handler(int sig) {
     int status;
     pid_t pid;
+    job_t *job;
+    proc_t *proc;
+    struct rusage ru;
     // Must reap potentially multiple children because signals are not queued.
     // Use WNOHANG or WUNTRACED so we can stop this loop as soon as no zombies are available.
-    while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED)) > 0) {
-        if (WIFSIGNALED(status)) {
-            printf("\nJob [%d] (%d) terminated by signal %d\n", pid2jid(pid), pid, SIGINT);
-            deletejob(jobs, pid);
-        } else if (WIFSTOPPED(status)) {
-            printf("\nJob [%d] (%d) stopped by signal %d\n", pid2jid(pid), pid, SIGTSTP);
-            getjobpid(jobs, pid)->state = ST;
-        } else if (WIFEXITED(status))
-            deletejob(jobs, pid);
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED, &ru)) > 0) {
+        if ((job = getjobpid(&jobs, pid)) == NULL || (proc = getproc(job, pid)) == NULL)
+            continue;
+        proc->status = status;
+        if (WIFSTOPPED(status)) {
+            trace_mark("stop", pid, job->jid, NULL);
+            // one stopped stage stops the job, report it once
+            proc->state = P_STOPPED;
+            if (job->state == FG)
+                last_status = 128 + WSTOPSIG(status);
+            if (job->state != ST)
+                printf("\nJob [%d] (%d) stopped by signal %d\n", job->jid, job->pid, WSTOPSIG(status));
+            job->state = ST;
+            continue;
+        }
+        reapproc(&jobs, job, proc);
+        usage_add(&job->ru, &ru);
+        trace_proc("run", proc->tstart, pid, job->jid, job->cmdline);
+        trace_mark("reap", pid, job->jid, NULL);
+        if (--job->nalive > 0)
+            continue;
+
+        // the whole job is done, its status is the last stage's
+        if (job->state == FG)
+            last_status = jobstatus(job);
+        if (job->done)
+            *job->done = jobstatus(job);
+        // report a stage killed by a signal, a closed pipe is routine
+        for (int i = 0; i < job->nprocs; i++) {
+            if (WIFSIGNALED(job->procs[i].status) && WTERMSIG(job->procs[i].status) != SIGPIPE) {
+                printf("\nJob [%d] (%d) terminated by signal %d%s\n", job->jid, job->pid,
+                       WTERMSIG(job->procs[i].status), limit_why(job, WTERMSIG(job->procs[i].status)));
+                break;
+            }
+        }
+        usage_done(job);
+        deletejob(&jobs, job->pid);
     }
 }
 
@@ -496,15 +865,10 @@ void sigchld_handler(int sig) {
  *    to the foreground job.
  */
 void sigint_handler(int sig) {
-    pid_t pid;
-    // loop through jobs then send signal
-    for (int i = 0; i < MPSH_MAXJOBS; i++) {
-        if (jobs[i].state == FG) {
-            pid = jobs[i].pid;
-            kill(-pid, SIGINT);
-            break;
-        }
-    }
+    // waitfg keeps track of the foreground job
+    if (jobs.fg != NULL)
+        kill(-jobs.fg->pid, SIGINT);
+    jobs.sigint = 1;
 }
 
 /*
@@ -513,135 +877,11 @@ void sigint_handler(int sig) {
  *     foreground job by sending a SIGTSTP.
  */
 void sigtstp_handler(int sig) {
-    pid_t pid;
-    // loop through jobs then send signal
-    for (int i = 0; i < MPSH_MAXJOBS; i++) {
-        if (jobs[i].state == FG) {
-            pid = jobs[i].pid;
-            kill(-pid, SIGTSTP);
-            break;
-        }
-    }
-}
-
-/***********************************************
- * Helper routines that manipulate the job list
- **********************************************/
-
-/* clearjob - Clear the entries in a job struct */
-void clearjob(job_t *job) {
-    job->pid = 0;
-    job->jid = 0;
-    job->state = UNDEF;
-    job->cmdline[0] = '\0';
-}
-
-/* initjobs - Initialize the job list */
-void initjobs(job_t *jobs) {
-    for (int i = 0; i < MPSH_MAXJOBS; i++)
-        clearjob(&jobs[i]);
+    // waitfg keeps track of the foreground job
+    if (jobs.fg != NULL)
+        kill(-jobs.fg->pid, SIGTSTP);
 }
 
-/* maxjid - Returns largest allocated job ID */
-int maxjid(job_t *jobs) {
-    int max = 0;
-    for (int i = 0; i < MPSH_MAXJOBS; i++)
-        if (jobs[i].jid > max)
-            max = jobs[i].jid;
-    return max;
-}
-
-/* addjob - Add a job to the job list */
-int addjob(job_t *jobs, pid_t pid, int state, char *cmdline) {
-    if (pid < 1)
-        return 0;
-    for (int i = 0; i < MPSH_MAXJOBS; i++) {
-        if (jobs[i].pid == 0) {
-            jobs[i].pid = pid;
-            jobs[i].state = state;
-            jobs[i].jid = nextjid++;
-            if (nextjid > MPSH_MAXJOBS)
-                nextjid = 1;
-            strcpy(jobs[i].cmdline, cmdline);
-            return 1;
-        }
-    }
-    printf("Tried to create too many jobs\n");
-    return 0;
-}
-
-/* deletejob - Delete a job whose PID=pid from the job list */
-int deletejob(job_t *jobs, pid_t pid) {
-    if (pid < 1)
-        return 0;
-    for (int i = 0; i < MPSH_MAXJOBS; i++) {
-        if (jobs[i].pid == pid) {
-            clearjob(&jobs[i]);
-            nextjid = maxjid(jobs) + 1;
-            return 1;
-        }
-    }
-    return 0;
-}
-
-/* getjobpid - Find a job (by PID) on the job list */
-job_t *getjobpid(job_t *jobs, pid_t pid) {
-    if (pid < 1)
-        return NULL;
-    for (int i = 0; i < MPSH_MAXJOBS; i++)
-        if (jobs[i].pid == pid)
-            return &jobs[i];
-    return NULL;
-}
-
-/* getjobjid - Find a job (by JID) on the job list */
-job_t *getjobjid(job_t *jobs, int jid) {
-    if (jid < 1)
-        return NULL;
-    for (int i = 0; i < MPSH_MAXJOBS; i++)
-        if (jobs[i].jid == jid)
-            return &jobs[i];
-    return NULL;
-}
-
-/* pid2jid - Map process ID to job ID */
-int pid2jid(pid_t pid) {
-    if (pid < 1)
-        return 0;
-    for (int i = 0; i < MPSH_MAXJOBS; i++)
-        if (jobs[i].pid == pid)
-            return jobs[i].jid;
-    return 0;
-}
-
-/* listjobs - Print the job list */
-int listjobs(job_t *jobs) {
-    for (int i = 0; i < MPSH_MAXJOBS; i++) {
-        if (jobs[i].pid != 0) {
-            printf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
-            switch (jobs[i].state) {
-                case BG:
-                    printf("Running ");
-                    break;
-                case FG:
-                    printf("Foreground ");
-                    break;
-                case ST:
-                    printf("Stopped ");
-                    break;
-                default:
-                    printf("listjobs: Internal error: job[%d].state=%d ", i, jobs[i].state);
-            }
-            printf("%s", jobs[i].cmdline);
-        }
-    }
-    return 1;
-}
-
-/******************************
- * end job list helper routines
- ******************************/
-
 /***********************
  * Other helper routines
  ***********************/
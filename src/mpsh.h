@@ -1,17 +1,49 @@
 #ifndef MPSH_H
 #define MPSH_H
 
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/time.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #define MPSH_TOK_BUFSIZE 32
-#define MPSH_CMDS 200
 #define MPSH_TOK_DELIM " \t\r\n\a"
-#define MPSH_MAXJOBS 16
-#define MPSH_MAXJID 1 << 16 /* max job ID */
+#define MPSH_JOBS_INIT 16 /* initial job table size, grows as needed */
+#define MPSH_ARENA_BLOCK 4096 /* first arena block size */
+#define MPSH_HASH_SIZE 64     /* initial command hash table size */
+#define MPSH_INBUF_SIZE 65536 /* stdin read buffer size */
+#define MPSH_BUILTIN_SLOTS 128 /* builtin hash slots to start with, power of 2 */
+#define MPSH_BUILTIN_SEEDS 1024 /* seeds tried before the table grows */
+#define MPSH_COPY_CHUNK (1 << 20) /* bytes moved per call by in-shell cat */
+#define MPSH_USAGE_TOP 5 /* costliest jobs kept for the session summary */
+#define MPSH_TRACE_EVENTS 65536 /* trace ring size, older events are overwritten */
+#define MPSH_POOL_MSG (128 * 1024) /* largest launch request, bigger ones fork */
+#define MPSH_HISTSIZE 1000 /* lines kept for history and !, unless $MPSH_HISTSIZE */
+#define MPSH_HIST_TRIGRAMS 65536 /* history search index slots, power of 2 */
+#define MPSH_GLOB_BUF (256 * 1024) /* getdents64 buffer for globbing */
+
+/* Launch modes */
+#define LAUNCH_FORK 0  /* fork + exec */
+#define LAUNCH_SPAWN 1 /* posix_spawn (vfork style) */
+#define LAUNCH_POOL 2  /* cloned by a small helper process */
+
+/* Pipe capacities, besides a size in bytes */
+#define PIPE_DEFAULT 0 /* what the kernel gives */
+#define PIPE_AUTO -1   /* wider for longer pipelines */
+
+/* CPU placement of a job (on cpus=) */
+#define PLACE_INHERIT 0 /* the shell's */
+#define PLACE_SET 1     /* the given CPUs */
+#define PLACE_AUTO 2    /* the next NUMA node (or CPU) for each background job */
 
 /* Job states */
 #define UNDEF 0 /* undefined */
@@ -19,61 +51,325 @@
 #define BG 2    /* running in background */
 #define ST 3    /* stopped */
 
-typedef struct job_t {              /* The job struct */
-    pid_t pid;                      /* job PID */
-    int jid;                        /* job ID [1, 2, ...] */
-    int state;                      /* UNDEF, BG, FG, or ST */
-    char cmdline[MPSH_TOK_BUFSIZE]; /* command line */
+/* Process states */
+#define P_RUNNING 0
+#define P_STOPPED 1
+#define P_DONE 2
+
+typedef struct proc_t { /* One process of a job */
+    pid_t pid;
+    int state;          /* P_RUNNING, P_STOPPED or P_DONE */
+    int status;         /* wait status once it changed */
+    unsigned long long tstart; /* trace_now() when it started */
+} proc_t;
+
+typedef struct job_t { /* The job struct */
+    pid_t pid;         /* job PID, also its process group */
+    int jid;           /* job ID [1, 2, ...] */
+    int state;         /* UNDEF, BG, FG, or ST */
+    char *cmdline;     /* command line, owned by the job */
+    proc_t *procs;     /* its processes, pipeline stages in order */
+    int nprocs, proccap;
+    int nalive;        /* processes not yet reaped */
+    struct timespec start; /* CLOCK_MONOTONIC when it started */
+    struct rusage ru;  /* used by its reaped processes, summed */
+    int *done;         /* gets its exit status when it finishes, if not NULL */
+    char *place;       /* its on settings as typed, owned by the job, or NULL */
+    char *limit;       /* its limit settings, owned by the job, or NULL */
+    char *cgroup;      /* its cgroup directory, removed with the job, or NULL */
 } job_t;
 
-job_t jobs[MPSH_MAXJOBS]; /* The job list */
+typedef struct pident_t { /* PID table entry */
+    pid_t pid;
+    job_t *job;           /* NULL if the slot is free */
+} pident_t;
+
+typedef struct joblist_t { /* The job list */
+    job_t **byjid;         /* job of each JID, NULL if free */
+    int jidcap;            /* slots in byjid */
+    int nextjid;           /* lowest JID never handed out */
+    int *freejids;         /* JIDs to reuse */
+    int nfree, freecap;
+    pident_t *bypid;       /* PID hash table, power of 2 size */
+    size_t pidcap, npids;
+    int njobs;             /* jobs in the list */
+    job_t *fg;             /* job waitfg is waiting on */
+    int sigint;            /* ctrl-c was typed, for builtins that wait */
+} joblist_t;
+
+extern joblist_t jobs; /* The job list */
+
+/* Bump allocator owning everything parsed from one line */
+typedef struct arena_block_t {
+    struct arena_block_t *next;
+    size_t size; /* usable bytes in data */
+    size_t used; /* bytes handed out */
+    char data[];
+} arena_block_t;
+
+typedef struct arena_t {
+    arena_block_t *head; /* current block */
+    void *last;          /* latest allocation, can grow in place */
+    size_t nsys;         /* blocks taken from malloc */
+    size_t nalloc;       /* allocations served */
+} arena_t;
+
+/* Redirection operators */
+#define R_IN 0      /* < */
+#define R_OUT 1     /* > */
+#define R_APPEND 2  /* >> */
+#define R_DUPIN 3   /* <& */
+#define R_DUPOUT 4  /* >& */
+#define R_BOTH 5    /* &> */
+#define R_BOTHAPP 6 /* &>> */
+#define R_HERE 7    /* <<< */
+
+/* File descriptor actions */
+#define FD_OPEN 0  /* open path onto fd */
+#define FD_DUP 1   /* dup src onto fd */
+#define FD_CLOSE 2 /* close fd */
+
+/* One step of a command's redirections, done in order in the child */
+typedef struct fdact_t {
+    int op;     /* FD_OPEN, FD_DUP or FD_CLOSE */
+    int fd;     /* fd it sets up */
+    int src;    /* FD_DUP: fd copied onto it */
+    int flags;  /* FD_OPEN: open flags */
+    char *path; /* FD_OPEN: the file */
+    int own;    /* src is the shell's, closed once the pipeline started (<<<) */
+} fdact_t;
+
+/* A simple command with its I/O redirections */
+typedef struct cmd_t {
+    char **argv;   /* NULL terminated argument vector */
+    int argc;      /* number of arguments */
+    fdact_t *acts; /* redirections, in order */
+    int nacts;     /* number of them */
+    int bg;        /* run in the background (&) */
+    int piped;     /* stdout feeds the next command (|) */
+    struct place_t *place; /* where and how its process runs, NULL for as the shell */
+    struct limit_t *limit; /* its resource limits and cgroup, NULL for none */
+} cmd_t;
+
+/* A redirection, as parsed */
+typedef struct redir_t {
+    int op;               /* R_IN, R_OUT, ... */
+    int fd;               /* fd it applies to */
+    char *word;           /* target, as typed */
+    struct redir_t *next; /* next one of the command */
+} redir_t;
+
+/* A simple command, as parsed: its words are expanded when it runs */
+typedef struct simple_t {
+    char **words;          /* as typed, quotes and all, NULL terminated */
+    int nwords;            /* number of words */
+    redir_t *redirs;       /* in the order typed */
+    struct simple_t *next; /* next command of the pipeline */
+} simple_t;
+
+/* Commands joined by | */
+typedef struct pipeline_t {
+    simple_t *cmds;          /* in the order typed */
+    int ncmds;               /* number of commands */
+    int bg;                  /* run in the background (&) */
+    struct pipeline_t *next; /* next pipeline of the list */
+} pipeline_t;
+
+/* A parsed line (or script): pipelines run one after the other */
+typedef struct list_t {
+    pipeline_t *head; /* first pipeline */
+    int npipes;       /* number of pipelines */
+} list_t;
+
+/* How the pipes of a pipeline are made */
+typedef struct pipecfg_t {
+    int size;   /* capacity in bytes, PIPE_DEFAULT or PIPE_AUTO */
+    int packet; /* O_DIRECT packet mode */
+} pipecfg_t;
+
+/* Where and how the processes of a job run */
+typedef struct place_t {
+    int cpus;       /* PLACE_INHERIT, PLACE_SET or PLACE_AUTO */
+    cpu_set_t mask; /* PLACE_SET: the CPUs */
+    int nice;       /* nice value, if hasnice */
+    int hasnice;
+    int policy;     /* SCHED_OTHER, SCHED_BATCH, ..., -1 to inherit */
+    int prio;       /* SCHED_FIFO, SCHED_RR: priority */
+} place_t;
 
-/* I/O redirections */
-typedef struct IO {
-    char **input;
-    char **output;
-} IO;
+/* Resource limits of a job, -1 for none */
+typedef struct limit_t {
+    long long mem;         /* memory.max of its cgroup, bytes */
+    long long cpumax;      /* cpu.max of its cgroup, percent of a CPU */
+    long long as, cpu;     /* rlimits of each process: address space bytes, CPU seconds */
+    long long nofile, nproc;
+    char cgroup[PATH_MAX]; /* its cgroup directory, empty for none */
+    int taken;             /* a job holds the cgroup */
+} limit_t;
 
-/* List of builtin commands */
-static char *builtin_str[] = {"help", "quit", "cd", "history", "jobs", "fg", "bg"};
+/* What a builtin gets to run with */
+typedef struct builtin_ctx_t {
+    char **argv;     /* NULL terminated argument vector */
+    int argc;        /* number of arguments */
+    cmd_t *cmd;      /* the command, with its redirections */
+    joblist_t *jobs; /* the job list */
+    int forked;      /* running in a pipeline child, not the shell */
+} builtin_ctx_t;
+
+typedef int builtin_fn(builtin_ctx_t *ctx);
+
+typedef struct builtin_t { /* Builtin table entry */
+    char *name;
+    builtin_fn *func;
+} builtin_t;
 
 /* forward declarations */
-char ***mpsh_split_line(char *line);
-int mpsh_execute(char ***args, char **cmds);
-int mpsh_launch(char ***args, sigset_t sigs);
-int mpsh_piping(char ***args, sigset_t sigs);
-int mpsh_history(char **cmds);
-int mpsh_cd(char **args);
-int mpsh_help(char **args);
-int mpsh_exit(char **args);
+list_t *mpsh_parse(const char *src, arena_t *a);
+void mpsh_expand_word(const char *word, arena_t *a, char ***out, int *cap, int *n);
+int mpsh_expand(simple_t *s, arena_t *a, cmd_t *cmd);
+int mpsh_execute(list_t *list);
+int mpsh_launch(cmd_t *cmd, sigset_t sigs);
+int mpsh_piping(cmd_t *cmds, int n, pipecfg_t *cfg, sigset_t sigs);
+int mpsh_history(builtin_ctx_t *ctx);
+void hist_init(const char *file);
+void hist_add(const char *line);
+void hist_tail(void);
+char *hist_enter(char *line);
+int mpsh_jobs(builtin_ctx_t *ctx);
+int mpsh_fgbg(builtin_ctx_t *ctx);
+int mpsh_echo(builtin_ctx_t *ctx);
+int mpsh_printf(builtin_ctx_t *ctx);
+int mpsh_true(builtin_ctx_t *ctx);
+int mpsh_false(builtin_ctx_t *ctx);
+int mpsh_test(builtin_ctx_t *ctx);
+int mpsh_pwd(builtin_ctx_t *ctx);
+void builtin_init(void);
+builtin_t *mpsh_find_builtin(char *name);
+void mpsh_builtin_child(cmd_t *cmd);
+int mpsh_cd(builtin_ctx_t *ctx);
+int mpsh_help(builtin_ctx_t *ctx);
+int mpsh_exit(builtin_ctx_t *ctx);
+int mpsh_hash(builtin_ctx_t *ctx);
+int mpsh_launch_mode(builtin_ctx_t *ctx);
 int mpsh_bg(int jid);
 int mpsh_fg(int jid);
-void mpsh_redirect(int pos);
+int mpsh_redirect(cmd_t *cmd);
+int redirect_save(cmd_t *cmd, int *saved);
+void redirect_restore(cmd_t *cmd, int *saved);
 void waitfg(pid_t pid);
-char *concatstr(char **str, int bg);
+char *concatstr(cmd_t *cmds, int n);
 char *mpsh_read_line();
-int mpsh_size_builtins();
 void mpsh_loop();
 
-int (*builtin_func[])(char **) = {
-    &mpsh_help,
-    &mpsh_exit,
-    &mpsh_cd,
-    &mpsh_history};
-
 void sigchld_handler(int sig);
 void sigtstp_handler(int sig);
 void sigint_handler(int sig);
 
 void clearjob(job_t *job);
-void initjobs(job_t *jobs);
-int maxjid(job_t *jobs);
-int addjob(job_t *jobs, pid_t pid, int state, char *cmdline);
-int deletejob(job_t *jobs, pid_t pid);
-job_t *getjobpid(job_t *jobs, pid_t pid);
-job_t *getjobjid(job_t *jobs, int jid);
+void initjobs(joblist_t *jl);
+job_t *addjob(joblist_t *jl, pid_t pid, int state, char *cmdline);
+void addproc(joblist_t *jl, job_t *job, pid_t pid);
+proc_t *getproc(job_t *job, pid_t pid);
+void reapproc(joblist_t *jl, job_t *job, proc_t *proc);
+void contjob(job_t *job, int state);
+int jobstatus(job_t *job);
+int deletejob(joblist_t *jl, pid_t pid);
+job_t *getjobpid(joblist_t *jl, pid_t pid);
+job_t *getjobjid(joblist_t *jl, int jid);
 int pid2jid(pid_t pid);
-int listjobs(job_t *jobs);
+int listjobs(joblist_t *jl);
+
+/* Start of a command timed by the time keyword */
+typedef struct usage_mark_t {
+    struct timespec start; /* CLOCK_MONOTONIC */
+    struct rusage self;    /* the shell's own usage */
+} usage_mark_t;
+
+double elapsed(struct timespec *start);
+void usage_add(struct rusage *sum, struct rusage *ru);
+void usage_done(job_t *job);
+void usage_live(job_t *job, struct rusage *ru);
+void usage_start(usage_mark_t *mark);
+void usage_report(usage_mark_t *mark);
+void usage_summary(FILE *f);
+int mpsh_times(builtin_ctx_t *ctx);
+
+extern int tracing;
+unsigned long long trace_now(void);
+void trace_span(const char *name, unsigned long long start, int jid, const char *arg);
+void trace_proc(const char *name, unsigned long long start, pid_t pid, int jid, const char *arg);
+void trace_mark(const char *name, pid_t pid, int jid, const char *arg);
+int trace_start(const char *path);
+int trace_flush(void);
+void trace_stop(void);
+int mpsh_trace(builtin_ctx_t *ctx);
+
+void *arena_alloc(arena_t *a, size_t n);
+void *arena_grow(arena_t *a, void *p, size_t old, size_t n);
+char *arena_strdup(arena_t *a, const char *s);
+void arena_reset(arena_t *a);
+void arena_free(arena_t *a);
+
+pid_t mpsh_spawn(cmd_t *cmd, char *path, int in, int out, pid_t pgid, sigset_t sigs);
+pid_t pool_spawn(cmd_t *cmd, char *path, int in, int out, pid_t pgid);
+int pool_helper(int sock);
+extern int launch_mode;
+extern int spawn_shellfd;
+
+extern pipecfg_t pipecfg;
+int mpsh_pipe(int fds[2], pipecfg_t *cfg, int n);
+int pipe_parse(char **args, pipecfg_t *cfg);
+int mpsh_pipesize(builtin_ctx_t *ctx);
+
+int mpsh_parallel(builtin_ctx_t *ctx);
+
+int mpsh_wait(builtin_ctx_t *ctx);
+
+extern place_t placecfg;
+int place_parse(char **args, place_t *p);
+place_t *place_resolve(place_t *cfg, int bg, place_t *out);
+int place_apply(place_t *p);
+char *place_str(place_t *p, char *buf, size_t size);
+void place_job(job_t *job, place_t *p);
+int mpsh_on(builtin_ctx_t *ctx);
+
+extern limit_t limitcfg;
+int limit_parse(char **args, limit_t *l);
+limit_t *limit_resolve(limit_t *cfg, limit_t *out);
+int limit_apply(limit_t *l);
+char *limit_str(limit_t *l, char *buf, size_t size);
+void limit_job(job_t *job, limit_t *l);
+void limit_done(limit_t *l);
+void limit_release(job_t *job);
+void limit_live(job_t *job, struct rusage *ru);
+const char *limit_why(job_t *job, int sig);
+int mpsh_limit(builtin_ctx_t *ctx);
+
+int cache_parse(char **args, int *content);
+int cache_run(cmd_t *cmd, int content, sigset_t sigs);
+int mpsh_cached(builtin_ctx_t *ctx);
+
+int mpsh_is_copy(cmd_t *cmd);
+int mpsh_copy_stage(cmd_t *cmds, int n);
+int mpsh_copy(cmd_t *cmd, int in, int out);
+
+int glob_meta(const char *w);
+int mpsh_glob(const char *pattern, arena_t *a, char ***matches);
+void glob_reset(void);
+
+char *hash_lookup(char *name);
+void hash_exec(char *path, char **args);
+void hash_forget(const char *name);
+void hash_clear(void);
+
+extern int last_status;
+
+void ev_init(void);
+void ev_input_fd(int fd);
+void ev_input_string(char *s);
+void ev_signals(void);
+void ev_wait_fd(int fd, int events);
+extern sigset_t evsigs;
 
 void unix_error(char *msg);
 typedef void handler_t(int);
@@ -0,0 +1,237 @@
+/*
+ * parallel - run a command over many items, N at a time
+ * like xargs -P or GNU parallel, but from inside the shell:
+ * a slot is refilled as soon as the event loop reaps its child,
+ * and with -g each child's output goes to a memfd, copied out
+ * whole when it is done so outputs never interleave
+ *
+ * @author Monthon Paul
+ * @version March 11, 2024
+ */
+#include "mpsh.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+
+typedef struct slot_t { /* A running item */
+    pid_t pid;          /* 0 if the slot is free */
+    int status;         /* exit status once done, -1 before */
+    int out;            /* memfd holding its output with -g, or -1 */
+} slot_t;
+
+/* par_items - Read the rest of stdin and split it into lines, the work items */
+static int par_items(char ***items, char **buf) {
+    size_t len = 0, size = MPSH_INBUF_SIZE;
+    ssize_t r;
+    int n = 0, cap = 0;
+
+    *items = NULL;
+    if ((*buf = malloc(size)) == NULL)
+        return -1;
+    while ((r = read(STDIN_FILENO, *buf + len, size - len - 1)) != 0) {
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            break;
+        len += r;
+        if (len + 1 == size && (*buf = realloc(*buf, size *= 2)) == NULL)
+            return -1;
+    }
+    (*buf)[len] = '\0';
+    for (char *line = strtok(*buf, "\n"); line; line = strtok(NULL, "\n")) {
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            if ((*items = realloc(*items, cap * sizeof(char *))) == NULL)
+                return -1;
+        }
+        (*items)[n++] = line;
+    }
+    return n;
+}
+
+/* par_subst - Copy a template word with every {} replaced by item */
+static char *par_subst(const char *word, const char *item) {
+    size_t ilen = strlen(item), len = strlen(word) + 1;
+    const char *p;
+    char *s, *q;
+
+    for (p = word; (p = strstr(p, "{}")) != NULL; p += 2)
+        len += ilen;
+    if ((s = q = malloc(len)) == NULL)
+        return NULL;
+    for (p = word; *p;) {
+        if (p[0] == '{' && p[1] == '}') {
+            q = stpcpy(q, item);
+            p += 2;
+        } else {
+            *q++ = *p++;
+        }
+    }
+    *q = '\0';
+    return s;
+}
+
+/* par_dump - Copy a finished item's grouped output to stdout */
+static void par_dump(int fd) {
+    char buf[8192];
+    off_t off = 0, size = lseek(fd, 0, SEEK_END);
+    ssize_t n;
+
+    fflush(stdout);
+    while (off < size && sendfile(STDOUT_FILENO, fd, &off, size - off) > 0) {
+    }
+    // sendfile refused (e.g. stdout opened for append): plain copy of the rest
+    lseek(fd, off, SEEK_SET);
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        if (write(STDOUT_FILENO, buf, n) != n)
+            break;
+    close(fd);
+}
+
+/**
+ * @brief Start one item, as a background job of its own.
+ * @param tmpl the command, its words may hold {}
+ * @param ntmpl number of words
+ * @param item the item
+ * @param slot receives the child
+ * @param in stdin for the child
+ * @param group give it a memfd for its output
+ * @return 0 if it started, -1 otherwise
+ */
+static int par_start(char **tmpl, int ntmpl, char *item, slot_t *slot, int in, int group) {
+    char *argv[ntmpl + 2], *path = NULL;
+    cmd_t cmd = {.argv = argv, .argc = 0};
+    int subst = 0, ret = -1;
+    job_t *job;
+
+    for (int i = 0; i < ntmpl; i++) {
+        subst |= strstr(tmpl[i], "{}") != NULL;
+        argv[cmd.argc++] = par_subst(tmpl[i], item);
+    }
+    if (!subst)
+        argv[cmd.argc++] = strdup(item);  // no {}: the item is the last argument
+    argv[cmd.argc] = NULL;
+
+    slot->out = group ? memfd_create("parallel", MFD_CLOEXEC) : -1;
+    slot->status = -1;
+    if (!mpsh_find_builtin(*argv) && (path = hash_lookup(*argv)) == NULL) {
+        fprintf(stderr, "parallel: %s: Command not found\n", *argv);
+    } else if ((slot->pid = mpsh_spawn(&cmd, path, in, slot->out, 0, evsigs)) > 0) {
+        job = addjob(&jobs, slot->pid, BG, concatstr(&cmd, 1));
+        job->done = &slot->status;
+        ret = 0;
+    }
+    if (ret == -1 && slot->out != -1)
+        close(slot->out);
+    for (int i = 0; i < cmd.argc; i++)
+        free(argv[i]);
+    if (ret == -1)
+        slot->pid = 0;
+    return ret;
+}
+
+/**
+ * @brief builtin parallel, run a command for every item, N at a time
+ * parallel [-j N|auto] [-g] cmd [args] [::: item ...]
+ * items are the words after :::, or else the lines of stdin.
+ * {} in the command is replaced by the item, or it is added at the end.
+ * -j how many run at once, auto (default) is the number of CPUs,
+ * -g hold each item's output until it is done, so none interleave.
+ * Exit status is the number of items that failed (101 for over 100).
+ * @param ctx arguments (including program) and context.
+ * @return Always returns 1, to continue execution.
+ */
+int mpsh_parallel(builtin_ctx_t *ctx) {
+    char **args = ctx->argv, **items = NULL, *buf = NULL;
+    int i = 1, nslots = sysconf(_SC_NPROCESSORS_ONLN), group = 0;
+    int ntmpl, nitems = 0, next = 0, running = 0, failed = 0, stopped = 0, in;
+    slot_t *slots;
+    char *end;
+    long n;
+
+    for (; args[i] && args[i][0] == '-'; i++) {
+        if (!strcmp(args[i], "-g")) {
+            group = 1;
+        } else if (!strcmp(args[i], "-j") && args[i + 1]) {
+            i++;
+            if (!strcmp(args[i], "auto"))
+                continue;
+            n = strtol(args[i], &end, 10);
+            if (end == args[i] || *end || n < 1 || n > INT_MAX)
+                break;  // a bad count is not the command
+            nslots = n;
+        } else {
+            break;
+        }
+    }
+    for (ntmpl = 0; args[i + ntmpl] && strcmp(args[i + ntmpl], ":::"); ntmpl++) {
+    }
+    if (ntmpl == 0 || (args[i] && args[i][0] == '-') || !strcmp(args[i - 1], "-j")) {
+        printf("usage: parallel [-j N|auto] [-g] cmd [args] [::: item ...]\n");
+        last_status = 2;
+        return 1;
+    }
+    if (args[i + ntmpl]) {
+        items = &args[i + ntmpl + 1];
+        while (items[nitems])
+            nitems++;
+    } else if ((nitems = par_items(&items, &buf)) == -1) {
+        fprintf(stderr, "parallel: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    if (nslots < 1)
+        nslots = 1;
+    // children get no terminal input, stdin may hold the items
+    if ((slots = calloc(nslots, sizeof(slot_t))) == NULL ||
+        (in = open("/dev/null", O_RDONLY | O_CLOEXEC)) == -1) {
+        perror("parallel");
+        exit(EXIT_FAILURE);
+    }
+
+    // a pipeline stage has them unblocked, the signalfd needs them blocked
+    if (ctx->forked)
+        sigprocmask(SIG_BLOCK, &evsigs, NULL);
+
+    // keep every slot busy, refill one each time the event loop reaps
+    jobs.sigint = 0;
+    while (next < nitems || running > 0) {
+        for (int s = 0; s < nslots && next < nitems && !jobs.sigint; s++) {
+            if (slots[s].pid)
+                continue;
+            if (par_start(&args[i], ntmpl, items[next++], &slots[s], in, group) == 0)
+                running++;
+            else
+                failed++;
+        }
+        if (running == 0)
+            break;
+        ev_signals();
+        for (int s = 0; s < nslots; s++) {
+            if (!slots[s].pid)
+                continue;
+            if (jobs.sigint && !stopped)
+                kill(-slots[s].pid, SIGINT);  // ctrl-c stops the whole run
+            if (slots[s].status == -1)
+                continue;
+            if (slots[s].out != -1)
+                par_dump(slots[s].out);
+            failed += slots[s].status != 0;
+            slots[s].pid = 0;
+            running--;
+        }
+        stopped = jobs.sigint;
+    }
+
+    close(in);
+    free(slots);
+    if (buf) {
+        free(buf);
+        free(items);
+    }
+    last_status = jobs.sigint ? 128 + SIGINT : (failed > 100 ? 101 : failed);
+    jobs.sigint = 0;
+    return 1;
+}
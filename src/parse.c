@@ -0,0 +1,401 @@
+/*
+ * parse - turn a line (or a whole script) into a command tree
+ * one pass over the text: the lexer hands out words and
+ * operators, the parser builds lists of pipelines of simple
+ * commands with their redirections, all in an arena. Words keep
+ * their quotes; they are expanded (quotes removed, globs matched)
+ * each time the command runs, so the tree itself never changes
+ *
+ * @author Monthon Paul
+ * @version March 11, 2024
+ */
+#include "mpsh.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define T_EOF 0     /* end of the text */
+#define T_WORD 256  /* a word; operators are their own character */
+#define T_REDIR 257 /* a redirection, see rop and rfd */
+#define T_ERR -1    /* unterminated quote */
+
+typedef struct parser_t {
+    const char *p;   /* next character */
+    int tok;         /* current token */
+    char *word;      /* its text, for T_WORD */
+    int rop, rfd;    /* operator and fd, for T_REDIR */
+    arena_t *a;      /* where the tree goes */
+    char **wv;       /* words of the command being parsed */
+    int wn, wcap;
+} parser_t;
+
+/* Characters that end a word outside quotes */
+static const char breaks[256] = {
+    ['\0'] = 1, [' '] = 1, ['\t'] = 1, ['\r'] = 1, ['\a'] = 1, ['\n'] = 1,
+    ['|'] = 1,  [';'] = 1, ['&'] = 1,  ['<'] = 1,  ['>'] = 1,
+};
+
+/* Text of each redirection operator, by R_IN, R_OUT, ... */
+static const char *redir_str[] = {"<", ">", ">>", "<&", ">&", "&>", "&>>", "<<<"};
+
+/* lex_redir - Read the redirection operator at p, for fd (-1: the operator's own) */
+static int lex_redir(parser_t *ps, const char *p, int fd) {
+    int op;
+
+    if (*p == '&')
+        op = (p[2] == '>') ? R_BOTHAPP : R_BOTH;
+    else if (*p == '<')
+        op = (p[1] == '<' && p[2] == '<') ? R_HERE : (p[1] == '&') ? R_DUPIN : R_IN;
+    else
+        op = (p[1] == '>') ? R_APPEND : (p[1] == '&') ? R_DUPOUT : R_OUT;
+    if (fd == -1)
+        fd = (op == R_IN || op == R_DUPIN || op == R_HERE) ? STDIN_FILENO : STDOUT_FILENO;
+    ps->rop = op;
+    ps->rfd = fd;
+    ps->p = p + strlen(redir_str[op]);
+    return ps->tok = T_REDIR;
+}
+
+/* lex - Read the next token */
+static int lex(parser_t *ps) {
+    const char *p = ps->p, *start;
+
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\a')
+        p++;
+    if (*p == '#')
+        while (*p && *p != '\n')
+            p++;  // a comment, up to the end of the line
+    if (*p == '\0') {
+        ps->p = p;
+        return ps->tok = T_EOF;
+    }
+    if (*p == '<' || *p == '>' || (*p == '&' && p[1] == '>'))
+        return lex_redir(ps, p, -1);
+    if (breaks[(unsigned char)*p]) {
+        ps->p = p + 1;
+        return ps->tok = *p;
+    }
+    // digits right before < or > are the fd it redirects: 2>err
+    for (start = p; *p >= '0' && *p <= '9' && p - start < 4; p++) {
+    }
+    if (p > start && (*p == '<' || *p == '>'))
+        return lex_redir(ps, p, atoi(start));
+
+    while (!breaks[(unsigned char)*p]) {
+        if (*p == '\\' && p[1]) {
+            p += 2;
+        } else if (*p == '\'' || *p == '"') {
+            char q = *p++;
+            while (*p && *p != q)
+                p += (q == '"' && *p == '\\' && p[1]) ? 2 : 1;
+            if (*p == '\0') {
+                fprintf(stderr, "mpsh: syntax error: unterminated %c\n", q);
+                return ps->tok = T_ERR;
+            }
+            p++;
+        } else {
+            p++;
+        }
+    }
+    ps->word = memcpy(arena_alloc(ps->a, p - start + 1), start, p - start);
+    ps->word[p - start] = '\0';
+    ps->p = p;
+    return ps->tok = T_WORD;
+}
+
+/* parse_error - Report the token the parser didn't expect */
+static void *parse_error(parser_t *ps) {
+    if (ps->tok == T_EOF || ps->tok == '\n')
+        fprintf(stderr, "mpsh: syntax error near `newline'\n");
+    else if (ps->tok == T_REDIR)
+        fprintf(stderr, "mpsh: syntax error near `%s'\n", redir_str[ps->rop]);
+    else if (ps->tok != T_ERR)
+        fprintf(stderr, "mpsh: syntax error near `%c'\n", ps->tok);
+    return NULL;
+}
+
+/* parse_simple - command := (word | redirection)+ */
+static simple_t *parse_simple(parser_t *ps) {
+    simple_t *cmd = arena_alloc(ps->a, sizeof(simple_t));
+    redir_t **tail = &cmd->redirs;
+
+    cmd->redirs = NULL;
+    cmd->next = NULL;
+    ps->wn = 0;
+    for (;;) {
+        if (ps->tok == T_WORD) {
+            if (ps->wn == ps->wcap) {
+                ps->wcap = ps->wcap ? ps->wcap * 2 : MPSH_TOK_BUFSIZE;
+                if ((ps->wv = realloc(ps->wv, ps->wcap * sizeof(char *))) == NULL) {
+                    fprintf(stderr, "mpsh: allocation error\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            ps->wv[ps->wn++] = ps->word;
+        } else if (ps->tok == T_REDIR) {
+            redir_t *r = arena_alloc(ps->a, sizeof(redir_t));
+            r->op = ps->rop;
+            r->fd = ps->rfd;
+            if (lex(ps) != T_WORD)
+                return parse_error(ps);
+            r->word = ps->word;
+            r->next = NULL;
+            *tail = r;
+            tail = &r->next;
+        } else {
+            break;
+        }
+        lex(ps);
+    }
+    if (ps->wn == 0 && cmd->redirs == NULL)
+        return parse_error(ps);
+    cmd->nwords = ps->wn;
+    cmd->words = arena_alloc(ps->a, (ps->wn + 1) * sizeof(char *));
+    memcpy(cmd->words, ps->wv, ps->wn * sizeof(char *));
+    cmd->words[ps->wn] = NULL;
+    return cmd;
+}
+
+/* parse_pipeline - pipeline := command ('|' command)* */
+static pipeline_t *parse_pipeline(parser_t *ps) {
+    pipeline_t *pl = arena_alloc(ps->a, sizeof(pipeline_t));
+    simple_t **tail = &pl->cmds;
+
+    pl->ncmds = 0;
+    pl->bg = 0;
+    pl->next = NULL;
+    for (;;) {
+        if ((*tail = parse_simple(ps)) == NULL)
+            return NULL;
+        tail = &(*tail)->next;
+        pl->ncmds++;
+        if (ps->tok != '|')
+            return pl;
+        lex(ps);
+    }
+}
+
+/**
+ * @brief Parse a line, or a whole script.
+ * list := pipeline ((';' | '&' | newline) pipeline)* [';' | '&']
+ * @param src the text
+ * @param a arena for the tree, which lives as long as it does
+ * @return the tree, or NULL (with a message) on a syntax error
+ */
+list_t *mpsh_parse(const char *src, arena_t *a) {
+    parser_t ps = {.p = src, .a = a};
+    list_t *list = arena_alloc(a, sizeof(list_t));
+    pipeline_t **tail = &list->head;
+
+    list->head = NULL;
+    list->npipes = 0;
+    lex(&ps);
+    while (ps.tok != T_EOF) {
+        if (ps.tok == '\n') {
+            lex(&ps);  // blank line
+            continue;
+        }
+        if ((*tail = parse_pipeline(&ps)) == NULL) {
+            list = NULL;
+            break;
+        }
+        if (ps.tok == T_ERR) {
+            list = NULL;  // unterminated quote, already reported
+            break;
+        }
+        (*tail)->bg = (ps.tok == '&');
+        tail = &(*tail)->next;
+        list->npipes++;
+        if (ps.tok != T_EOF)
+            lex(&ps);
+    }
+    free(ps.wv);
+    return list;
+}
+
+/* xword - Add n bytes to a word being expanded */
+static void xword(char **buf, size_t *len, size_t *cap, const char *s, size_t n) {
+    if (*len + n + 1 > *cap) {
+        *cap = (*len + n + 1) * 2;
+        if ((*buf = realloc(*buf, *cap)) == NULL) {
+            fprintf(stderr, "mpsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(*buf + *len, s, n);
+    *len += n;
+    (*buf)[*len] = '\0';
+}
+
+/* xadd - Append fields to an expanded argv, keeping it NULL terminated */
+static void xadd(arena_t *a, char ***out, int *cap, int *n, char **f, int nf) {
+    if (*n + nf + 1 > *cap) {
+        int old = *cap;
+        while (*n + nf + 1 > *cap)
+            *cap = *cap ? *cap * 2 : MPSH_TOK_BUFSIZE;
+        *out = arena_grow(a, *out, old * sizeof(char *), *cap * sizeof(char *));
+    }
+    memcpy(*out + *n, f, nf * sizeof(char *));
+    *n += nf;
+    (*out)[*n] = NULL;
+}
+
+/**
+ * @brief Expand a word: remove its quotes and backslashes, and
+ * match it as a glob when it has unquoted *, ? or [.
+ * @param word the word as typed
+ * @param a arena for the results
+ * @param out receives the fields (a word may become many)
+ * @param cap capacity of *out, in entries, updated when grown
+ * @param n number of fields in *out, updated
+ */
+void mpsh_expand_word(const char *word, arena_t *a, char ***out, int *cap, int *n) {
+    static char *lit, *pat;  /* the word without quotes, and as a glob pattern */
+    static size_t litcap, patcap;
+    size_t litlen = 0, patlen = 0;
+    char **matches, *field = (char *)word, q = 0;
+    int glob = 0, nm;
+
+    // nothing to expand: the word is the field
+    if (strpbrk(word, "'\"\\*?[") == NULL) {
+        xadd(a, out, cap, n, &field, 1);
+        return;
+    }
+    for (const char *p = word; *p; p++) {
+        // quoted: as it is, and escaped in the pattern
+        if (q == 0 && (*p == '\'' || *p == '"')) {
+            q = *p;
+        } else if (q && *p == q) {
+            q = 0;
+        } else if (*p == '\\' && p[1] && q != '\'' &&
+                   (q == 0 || strchr("\"\\$`", p[1]))) {
+            p++;
+            xword(&lit, &litlen, &litcap, p, 1);
+            xword(&pat, &patlen, &patcap, "\\", 1);
+            xword(&pat, &patlen, &patcap, p, 1);
+        } else {
+            xword(&lit, &litlen, &litcap, p, 1);
+            if (q && strchr("*?[]\\", *p))
+                xword(&pat, &patlen, &patcap, "\\", 1);
+            xword(&pat, &patlen, &patcap, p, 1);
+            glob |= (q == 0 && strchr("*?[", *p));
+        }
+    }
+
+    if (glob && glob_meta(pat) && (nm = mpsh_glob(pat, a, &matches)) > 0) {
+        xadd(a, out, cap, n, matches, nm);
+    } else {
+        // no match: the word as it is, less its quotes ("" is an empty field)
+        field = arena_strdup(a, litlen ? lit : "");
+        xadd(a, out, cap, n, &field, 1);
+    }
+}
+
+/* xhere - A memfd holding a here-string and a newline, read from the start */
+static int xhere(const char *w) {
+    size_t len = strlen(w);
+    int fd = memfd_create("mpsh-here", MFD_CLOEXEC);
+
+    if (fd == -1 || write(fd, w, len) != len || write(fd, "\n", 1) != 1 ||
+        lseek(fd, 0, SEEK_SET) == -1) {
+        perror("mpsh: here-string");
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* xredir - Add the fd actions of redirection r to word w, -1 (reported) if it can't be done */
+static int xredir(cmd_t *cmd, redir_t *r, char *w) {
+    fdact_t *a = &cmd->acts[cmd->nacts];
+
+    memset(a, 0, 2 * sizeof(fdact_t));
+    a->fd = r->fd;
+    switch (r->op) {
+        case R_IN:
+        case R_OUT:
+        case R_APPEND:
+            a->op = FD_OPEN;
+            a->path = w;
+            a->flags = (r->op == R_IN) ? O_RDONLY
+                     : O_WRONLY | O_CREAT | (r->op == R_APPEND ? O_APPEND : O_TRUNC);
+            cmd->nacts++;
+            return 0;
+        case R_HERE:
+            if ((a->src = xhere(w)) == -1)
+                return -1;
+            a->op = FD_DUP;
+            a->own = 1;
+            cmd->nacts++;
+            return 0;
+        case R_DUPIN:
+        case R_DUPOUT:
+            // n>&m, n>&- closes n, and >&file is &>file
+            if (!strcmp(w, "-")) {
+                a->op = FD_CLOSE;
+                cmd->nacts++;
+                return 0;
+            }
+            if (*w && w[strspn(w, "0123456789")] == '\0') {
+                a->op = FD_DUP;
+                a->src = atoi(w);
+                cmd->nacts++;
+                return 0;
+            }
+            if (r->op == R_DUPIN || r->fd != STDOUT_FILENO) {
+                fprintf(stderr, "mpsh: %s: ambiguous redirect\n", w);
+                return -1;
+            }
+    }
+    // &> and &>>: stdout to the file, stderr to stdout
+    a[0].op = FD_OPEN;
+    a[0].fd = STDOUT_FILENO;
+    a[0].path = w;
+    a[0].flags = O_WRONLY | O_CREAT | (r->op == R_BOTHAPP ? O_APPEND : O_TRUNC);
+    a[1].op = FD_DUP;
+    a[1].fd = STDERR_FILENO;
+    a[1].src = STDOUT_FILENO;
+    cmd->nacts += 2;
+    return 0;
+}
+
+/**
+ * @brief Expand a parsed simple command into one to run.
+ * @param s the command from the tree, left as it is
+ * @param a arena for the expansion, which lives as long as it runs
+ * @param cmd receives the command, with its redirections as fd actions
+ * @return 0, or -1 (reported) if a redirection can't be set up; the
+ *         here-strings made so far are in cmd->acts to be closed
+ */
+int mpsh_expand(simple_t *s, arena_t *a, cmd_t *cmd) {
+    int cap = 0, nr = 0;
+
+    memset(cmd, 0, sizeof(cmd_t));
+    for (int i = 0; i < s->nwords; i++)
+        mpsh_expand_word(s->words[i], a, &cmd->argv, &cap, &cmd->argc);
+    if (cmd->argv == NULL)
+        cmd->argv = arena_alloc(a, sizeof(char *));
+    cmd->argv[cmd->argc] = NULL;
+
+    // a redirection makes at most two actions
+    for (redir_t *r = s->redirs; r; r = r->next)
+        nr++;
+    if (nr)
+        cmd->acts = arena_alloc(a, 2 * nr * sizeof(fdact_t));
+    // its target is one word, a glob matching several files names none
+    for (redir_t *r = s->redirs; r; r = r->next) {
+        char **w = NULL;
+        int wcap = 0, wn = 0;
+        mpsh_expand_word(r->word, a, &w, &wcap, &wn);
+        if (wn > 1 && r->op != R_HERE) {
+            fprintf(stderr, "mpsh: %s: ambiguous redirect\n", r->word);
+            return -1;
+        }
+        if (xredir(cmd, r, w[0]) == -1)
+            return -1;
+    }
+    return 0;
+}
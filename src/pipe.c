@@ -0,0 +1,130 @@
+/*
+ * pipe - the pipes between pipeline stages
+ * their capacity is set with F_SETPIPE_SZ, for the whole shell
+ * or one pipeline, so bursty stages block and wake up less often,
+ * and they can be in O_DIRECT packet mode
+ *
+ * @author Monthon Paul
+ * @version March 11, 2024
+ */
+#include "mpsh.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PIPE_UNIT 65536 /* default pipe capacity, auto mode adds one per stage */
+
+pipecfg_t pipecfg = {PIPE_DEFAULT, 0}; /* what new pipelines get */
+
+/* pipe_max - Largest capacity an unprivileged process may set */
+static int pipe_max(void) {
+    static int max;
+    FILE *f;
+
+    if (max)
+        return max;
+    max = 1048576;
+    if ((f = fopen("/proc/sys/fs/pipe-max-size", "re")) != NULL) {
+        if (fscanf(f, "%d", &max) != 1 || max < PIPE_UNIT)
+            max = 1048576;
+        fclose(f);
+    }
+    return max;
+}
+
+/**
+ * @brief Make a pipe between two stages of a pipeline.
+ * Sizes the kernel refuses fall back to the most it allows,
+ * or else to its default.
+ * @param fds receives the read and write end, both close-on-exec
+ * @param cfg capacity and mode of the pipe
+ * @param n number of stages in the pipeline
+ * @return 0 on success, -1 if no pipe could be made
+ */
+int mpsh_pipe(int fds[2], pipecfg_t *cfg, int n) {
+    int size = cfg->size;
+
+    if (pipe2(fds, O_CLOEXEC | (cfg->packet ? O_DIRECT : 0)) == -1 &&
+        (!cfg->packet || pipe2(fds, O_CLOEXEC) == -1)) {
+        perror("mpsh: pipe");
+        return -1;
+    }
+    // more stages, more wakeups per byte: give each one more room
+    if (size == PIPE_AUTO)
+        size = (n < pipe_max() / PIPE_UNIT) ? n * PIPE_UNIT : pipe_max();
+    if (size != PIPE_DEFAULT && fcntl(fds[1], F_SETPIPE_SZ, size) == -1 && size > pipe_max())
+        fcntl(fds[1], F_SETPIPE_SZ, pipe_max());
+    return 0;
+}
+
+/**
+ * @brief Parse the options of pipesize: [-p] N|auto|default,
+ * N in bytes or with a k or m suffix.
+ * @param args the pipesize command
+ * @param cfg receives the settings
+ * @return index of the first word after them, or -1 if they are wrong
+ */
+int pipe_parse(char **args, pipecfg_t *cfg) {
+    int i = 1;
+    char *end;
+    long size;
+
+    cfg->packet = 0;
+    if (args[i] && !strcmp(args[i], "-p")) {
+        cfg->packet = 1;
+        i++;
+    }
+    if (!args[i])
+        return -1;
+    if (!strcmp(args[i], "auto")) {
+        cfg->size = PIPE_AUTO;
+    } else if (!strcmp(args[i], "default")) {
+        cfg->size = PIPE_DEFAULT;
+    } else {
+        size = strtol(args[i], &end, 10);
+        if (*end == 'k' || *end == 'K') {
+            size <<= 10;
+            end++;
+        } else if (*end == 'm' || *end == 'M') {
+            size <<= 20;
+            end++;
+        }
+        if (*end || size <= 0 || size > INT_MAX)
+            return -1;
+        cfg->size = size;
+    }
+    return i + 1;
+}
+
+/**
+ * @brief builtin pipesize, show or set the capacity of pipes
+ * pipesize                      print the current setting
+ * pipesize [-p] N|auto|default  set it for the pipelines to come
+ * pipesize [-p] N|auto cmd | ...  only for this pipeline (see mpsh_execute)
+ * -p makes packet mode (O_DIRECT) pipes, auto widens them with the
+ * number of stages
+ * @param ctx arguments (including program) and context.
+ * @return Always returns 1, to continue execution.
+ */
+int mpsh_pipesize(builtin_ctx_t *ctx) {
+    pipecfg_t cfg;
+
+    if (ctx->argc == 1) {
+        if (pipecfg.size == PIPE_AUTO)
+            printf("auto");
+        else if (pipecfg.size == PIPE_DEFAULT)
+            printf("default");
+        else
+            printf("%d", pipecfg.size);
+        printf("%s\n", pipecfg.packet ? " packet" : "");
+        return 1;
+    }
+    if (pipe_parse(ctx->argv, &cfg) != ctx->argc) {
+        printf("usage: pipesize [-p] N|auto|default [command]\n");
+        last_status = 2;
+        return 1;
+    }
+    pipecfg = cfg;
+    return 1;
+}
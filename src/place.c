@@ -0,0 +1,278 @@
+/*
+ * place - where and how the processes of a job run
+ * `on cpus=LIST nice=N sched=POLICY[:PRIO] cmd | ...` sets the CPU
+ * affinity, nice value and scheduling policy of every process of
+ * the pipeline, in the child between fork and exec, so no taskset
+ * or nice process is needed. cpus=auto spreads background jobs over
+ * the NUMA nodes in turn, or over the CPUs when there is one node.
+ * `on` with settings alone makes them the default for later jobs
+ *
+ * @author Monthon Paul
+ * @version March 11, 2024
+ */
+#include "mpsh.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+place_t placecfg = {PLACE_INHERIT, .policy = -1}; /* what new jobs get */
+
+static const struct {
+    char *name;
+    int policy;
+} policies[] = {
+    {"other", SCHED_OTHER}, {"batch", SCHED_BATCH}, {"idle", SCHED_IDLE},
+    {"fifo", SCHED_FIFO},   {"rr", SCHED_RR},
+};
+
+static cpu_set_t *units; /* what cpus=auto hands out in turn: nodes, or CPUs */
+static int nunits, nextunit;
+
+/* place_cpulist - Parse a CPU list such as 0-7,16; -1 if it is wrong */
+static int place_cpulist(const char *s, cpu_set_t *set) {
+    char *end;
+    long lo, hi;
+
+    CPU_ZERO(set);
+    do {
+        lo = hi = strtol(s, &end, 10);
+        if (end == s || lo < 0)
+            return -1;
+        if (*end == '-') {
+            s = end + 1;
+            hi = strtol(s, &end, 10);
+            if (end == s || hi < lo)
+                return -1;
+        }
+        if (hi >= CPU_SETSIZE)
+            return -1;
+        for (long c = lo; c <= hi; c++)
+            CPU_SET(c, set);
+        s = end + 1;
+    } while (*end == ',');
+    return (*end || CPU_COUNT(set) == 0) ? -1 : 0;
+}
+
+/* place_units - Find the NUMA nodes (or CPUs) the shell may run on, once */
+static void place_units(void) {
+    cpu_set_t mine, node;
+    char path[64], list[4096], *cpus;
+    FILE *f;
+
+    if (units)
+        return;
+    if ((units = malloc(CPU_SETSIZE * sizeof(cpu_set_t))) == NULL) {
+        fprintf(stderr, "mpsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    sched_getaffinity(0, sizeof(mine), &mine);
+    for (int n = 0; nunits < CPU_SETSIZE; n++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+        if ((f = fopen(path, "re")) == NULL)
+            break;
+        // a memory-only node (CXL, PMEM) has an empty list
+        if (fgets(list, sizeof(list), f) && (cpus = strtok(list, "\n")) != NULL &&
+            place_cpulist(cpus, &node) == 0) {
+            CPU_AND(&node, &node, &mine);
+            if (CPU_COUNT(&node))
+                units[nunits++] = node;
+        }
+        fclose(f);
+    }
+    // one node: spread over its CPUs instead
+    if (nunits < 2) {
+        nunits = 0;
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, &mine)) {
+                CPU_ZERO(&units[nunits]);
+                CPU_SET(c, &units[nunits++]);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Parse the settings of on: cpus=LIST|auto, nice=N,
+ * sched=other|batch|idle|fifo|rr[:PRIO], at least one of them.
+ * @param args the on command
+ * @param p receives the settings
+ * @return index of the first word after them, or -1 if they are wrong
+ */
+int place_parse(char **args, place_t *p) {
+    int i = 1;
+    char *v, *end;
+
+    *p = (place_t){PLACE_INHERIT, .policy = -1};
+    for (; args[i] && (v = strchr(args[i], '=')) != NULL; i++) {
+        v++;
+        if (!strncmp(args[i], "cpus=", 5)) {
+            if (!strcmp(v, "auto"))
+                p->cpus = PLACE_AUTO;
+            else if (place_cpulist(v, &p->mask) == 0)
+                p->cpus = PLACE_SET;
+            else
+                return -1;
+        } else if (!strncmp(args[i], "nice=", 5)) {
+            p->nice = strtol(v, &end, 10);
+            if (end == v || *end || p->nice < -20 || p->nice > 19)
+                return -1;
+            p->hasnice = 1;
+        } else if (!strncmp(args[i], "sched=", 6)) {
+            int k = 0, n = sizeof(policies) / sizeof(policies[0]);
+            while (k < n && strncmp(v, policies[k].name, strcspn(v, ":")))
+                k++;
+            if (k == n || strlen(policies[k].name) != strcspn(v, ":"))
+                return -1;
+            p->policy = policies[k].policy;
+            p->prio = (p->policy == SCHED_FIFO || p->policy == SCHED_RR) ? 1 : 0;
+            if ((end = strchr(v, ':')) != NULL) {
+                p->prio = strtol(end + 1, &end, 10);
+                if (*end || p->prio < sched_get_priority_min(p->policy) ||
+                    p->prio > sched_get_priority_max(p->policy))
+                    return -1;
+            }
+        } else {
+            return -1;
+        }
+    }
+    return i > 1 ? i : -1;
+}
+
+/**
+ * @brief The settings a pipeline starts with: cpus=auto becomes the
+ * next node or CPU for a background one, and the shell's own for
+ * the foreground, which should not wait on a busy CPU.
+ * @param cfg the settings
+ * @param bg the pipeline runs in the background
+ * @param out receives the settings to apply
+ * @return out, or NULL if there is nothing to change
+ */
+place_t *place_resolve(place_t *cfg, int bg, place_t *out) {
+    *out = *cfg;
+    if (cfg->cpus == PLACE_AUTO) {
+        out->cpus = PLACE_INHERIT;
+        if (bg) {
+            place_units();
+            if (nunits) {
+                out->cpus = PLACE_SET;
+                out->mask = units[nextunit++ % nunits];
+            }
+        }
+    }
+    return (out->cpus == PLACE_INHERIT && !out->hasnice && out->policy == -1) ? NULL : out;
+}
+
+/**
+ * @brief Apply settings to the calling process, a child about to exec.
+ * @param p the settings, NULL for none
+ * @return 0, or -1 if one could not be applied (and was reported)
+ */
+int place_apply(place_t *p) {
+    struct sched_param sp;
+
+    if (p == NULL)
+        return 0;
+    sp.sched_priority = p->prio;
+    if (p->cpus == PLACE_SET && sched_setaffinity(0, sizeof(cpu_set_t), &p->mask) == -1) {
+        perror("mpsh: on: cpus");
+        return -1;
+    }
+    if (p->policy != -1 && sched_setscheduler(0, p->policy, &sp) == -1) {
+        perror("mpsh: on: sched");
+        return -1;
+    }
+    if (p->hasnice && setpriority(PRIO_PROCESS, 0, p->nice) == -1) {
+        perror("mpsh: on: nice");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Write settings the way on takes them, e.g. cpus=0-3,8 nice=10.
+ * @param p the settings
+ * @param buf receives the text, empty for none
+ * @param size size of buf
+ * @return buf
+ */
+char *place_str(place_t *p, char *buf, size_t size) {
+    size_t len = 0;
+
+    buf[0] = '\0';
+    if (p->cpus == PLACE_AUTO) {
+        len += snprintf(buf + len, size - len, "cpus=auto ");
+    } else if (p->cpus == PLACE_SET) {
+        len += snprintf(buf + len, size - len, "cpus=");
+        for (int c = 0; c < CPU_SETSIZE && len < size; c++) {
+            int e = c;
+            if (!CPU_ISSET(c, &p->mask))
+                continue;
+            while (e + 1 < CPU_SETSIZE && CPU_ISSET(e + 1, &p->mask))
+                e++;
+            len += (e > c) ? snprintf(buf + len, size - len, "%d-%d,", c, e)
+                           : snprintf(buf + len, size - len, "%d,", c);
+            c = e;
+        }
+        if (len < size)
+            buf[len - 1] = ' ';
+    }
+    if (p->hasnice && len < size)
+        len += snprintf(buf + len, size - len, "nice=%d ", p->nice);
+    for (int k = 0; p->policy != -1 && k < sizeof(policies) / sizeof(policies[0]); k++) {
+        if (policies[k].policy == p->policy && len < size)
+            len += snprintf(buf + len, size - len, p->prio ? "sched=%s:%d " : "sched=%s ",
+                            policies[k].name, p->prio);
+    }
+    if (len && len < size)
+        buf[len - 1] = '\0';  // the last space
+    return buf;
+}
+
+/**
+ * @brief Keep the settings a job was started with, for listjobs.
+ * @param job the job, NULL if it could not be added
+ * @param p its settings, NULL for none
+ */
+void place_job(job_t *job, place_t *p) {
+    char buf[256];
+
+    if (job == NULL || p == NULL)
+        return;
+    if ((job->place = strdup(place_str(p, buf, sizeof(buf)))) == NULL) {
+        fprintf(stderr, "mpsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief builtin on, show or set where and how jobs run
+ * on                     print the settings later jobs get
+ * on SETTINGS            make them the default
+ * on default             back to running as the shell does
+ * on SETTINGS cmd | ...  only for this pipeline (see mpsh_execute)
+ * SETTINGS are cpus=LIST|auto, nice=N, sched=other|batch|idle|fifo|rr[:PRIO]
+ * @param ctx arguments (including program) and context.
+ * @return Always returns 1, to continue execution.
+ */
+int mpsh_on(builtin_ctx_t *ctx) {
+    char buf[256];
+    place_t p;
+
+    if (ctx->argc == 1) {
+        place_str(&placecfg, buf, sizeof(buf));
+        printf("%s\n", *buf ? buf : "default");
+        return 1;
+    }
+    if (ctx->argc == 2 && !strcmp(ctx->argv[1], "default")) {
+        placecfg = (place_t){PLACE_INHERIT, .policy = -1};
+        return 1;
+    }
+    if (place_parse(ctx->argv, &p) != ctx->argc) {
+        printf("usage: on [cpus=LIST|auto] [nice=N] [sched=POLICY[:PRIO]] [command]\n");
+        last_status = 2;
+        return 1;
+    }
+    placecfg = p;
+    return 1;
+}
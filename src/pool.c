@@ -0,0 +1,237 @@
+/*
+ * pool - launch commands from a small helper process
+ * forking the shell copies its page tables, which grow with its
+ * heap; the helper is mpsh exec'd afresh, so it stays small. The
+ * shell sends it argv, env, cwd and the stdio fds over a socketpair
+ * (SCM_RIGHTS), it clones the command with CLONE_PARENT, so the
+ * command is the shell's child, reaped and job controlled as usual,
+ * and replies with its pid
+ *
+ * @author Monthon Paul
+ * @version March 11, 2024
+ */
+#include "mpsh.h"
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+extern char **environ;
+
+typedef struct pool_req_t { /* A launch request, strings follow */
+    pid_t pgid;             /* process group to join, 0 to lead a new one */
+    int argc, envc;
+    int nacts;              /* fd actions follow, then their file names */
+    int hasplace;           /* place holds the on settings */
+    place_t place;
+    int haslimit;           /* limit holds the limits */
+    limit_t limit;
+} pool_req_t;
+
+static int pool_sock = -1;  /* shell's end of the socketpair */
+
+/* pool_put - Append a string to a request */
+static char *pool_put(char *p, const char *s) {
+    return stpcpy(p, s) + 1;
+}
+
+/* pool_start - Start the helper, mpsh run again with --pool */
+static int pool_start(void) {
+    int sv[2];
+    char fd[16];
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1)
+        return -1;
+    if ((pid = fork()) == 0) {
+        setpgid(0, 0);  // out of the way of ctrl-c at the prompt
+        fcntl(sv[1], F_SETFD, 0);
+        snprintf(fd, sizeof(fd), "%d", sv[1]);
+        execl("/proc/self/exe", "mpsh", "--pool", fd, (char *)NULL);
+        _exit(127);
+    }
+    close(sv[1]);
+    if (pid < 0) {
+        close(sv[0]);
+        return -1;
+    }
+    pool_sock = sv[0];
+    return 0;
+}
+
+/**
+ * @brief Start cmd through the helper.
+ * @param cmd the command (program, arguments and redirections)
+ * @param path resolved program
+ * @param in fd to use as stdin, or -1 to pass the shell's
+ * @param out fd to use as stdout, or -1 to pass the shell's
+ * @param pgid process group to join, 0 to lead a new one
+ * @return the child pid, -1 if it could not be started,
+ *         or -2 if the helper can't be used (fork instead)
+ */
+pid_t pool_spawn(cmd_t *cmd, char *path, int in, int out, pid_t pgid) {
+    pool_req_t req = {pgid, cmd->argc, 0, cmd->nacts, cmd->place != NULL};
+    int fds[3] = {in == -1 ? STDIN_FILENO : in, out == -1 ? STDOUT_FILENO : out, STDERR_FILENO};
+    char cwd[PATH_MAX], *buf, *p;
+    char ctl[CMSG_SPACE(sizeof(fds))] = {0};
+    size_t len = sizeof(req);
+    pid_t pid;
+
+    if (pool_sock == -1 && pool_start() == -1)
+        return -2;
+    if (cmd->place)
+        req.place = *cmd->place;
+    if ((req.haslimit = (cmd->limit != NULL)))
+        req.limit = *cmd->limit;
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        return -2;
+
+    len += strlen(path) + strlen(cwd) + 2 + cmd->nacts * sizeof(fdact_t);
+    for (int i = 0; i < cmd->nacts; i++) {
+        // the helper only has the stdio fds, a here-string's is the shell's
+        if (cmd->acts[i].op == FD_DUP && (cmd->acts[i].own || cmd->acts[i].src > STDERR_FILENO))
+            return -2;
+        if (cmd->acts[i].op == FD_OPEN)
+            len += strlen(cmd->acts[i].path) + 1;
+    }
+    for (int i = 0; i < cmd->argc; i++)
+        len += strlen(cmd->argv[i]) + 1;
+    for (req.envc = 0; environ[req.envc]; req.envc++)
+        len += strlen(environ[req.envc]) + 1;
+    if (len > MPSH_POOL_MSG || (buf = malloc(len)) == NULL)
+        return -2;  // too big for one message
+
+    memcpy(buf, &req, sizeof(req));
+    memcpy(buf + sizeof(req), cmd->acts, cmd->nacts * sizeof(fdact_t));
+    p = pool_put(buf + sizeof(req) + cmd->nacts * sizeof(fdact_t), path);
+    p = pool_put(p, cwd);
+    for (int i = 0; i < cmd->nacts; i++)
+        if (cmd->acts[i].op == FD_OPEN)
+            p = pool_put(p, cmd->acts[i].path);
+    for (int i = 0; i < cmd->argc; i++)
+        p = pool_put(p, cmd->argv[i]);
+    for (int i = 0; i < req.envc; i++)
+        p = pool_put(p, environ[i]);
+
+    struct iovec iov = {buf, len};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl,
+                         .msg_controllen = sizeof(ctl)};
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(c), fds, sizeof(fds));
+
+    if (sendmsg(pool_sock, &msg, MSG_NOSIGNAL) != len ||
+        recv(pool_sock, &pid, sizeof(pid), 0) != sizeof(pid)) {
+        // the helper is gone, start a new one next time
+        close(pool_sock);
+        pool_sock = -1;
+        free(buf);
+        return -2;
+    }
+    free(buf);
+    if (pid < 0) {
+        fprintf(stderr, "mpsh: %s: %s\n", *cmd->argv, strerror(-pid));
+        return -1;
+    }
+    return pid;
+}
+
+/* pool_child - In the new process: set it up and exec */
+static void pool_child(pool_req_t *req, char *path, char *cwd, cmd_t *cmd, char **envp,
+                       int fds[3]) {
+    setpgid(0, req->pgid);
+    if (place_apply(cmd->place) == -1 || limit_apply(cmd->limit) == -1)
+        _exit(EXIT_FAILURE);
+    for (int fd = 0; fd < 3; fd++)
+        dup2(fds[fd], fd);
+    if (chdir(cwd) == -1)
+        perror("mpsh");
+    if (mpsh_redirect(cmd) == -1)
+        _exit(EXIT_FAILURE);
+    execve(path, cmd->argv, envp);
+    printf("%s: Command not found\n", *cmd->argv);
+    fflush(stdout);
+    _exit(EXIT_FAILURE);
+}
+
+/**
+ * @brief The helper: take requests until the shell goes away.
+ * @param sock its end of the socketpair
+ * @return exit status
+ */
+int pool_helper(int sock) {
+    static char buf[MPSH_POOL_MSG];
+    char ctl[CMSG_SPACE(3 * sizeof(int))];
+    sigset_t none;
+    ssize_t n;
+
+    // not for the commands it starts
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+    // undo what the shell had: blocked job control signals, ignored SIGTTOU
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    signal(SIGTTOU, SIG_DFL);
+
+    for (;;) {
+        struct iovec iov = {buf, sizeof(buf) - 1};
+        struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl,
+                             .msg_controllen = sizeof(ctl)};
+        struct cmsghdr *c;
+        pool_req_t req;
+        cmd_t cmd = {0};
+        int fds[3];
+        pid_t pid;
+
+        if ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;  // the shell has gone
+        c = CMSG_FIRSTHDR(&msg);
+        if (n < (ssize_t)sizeof(req) || c == NULL || c->cmsg_len != CMSG_LEN(sizeof(fds)))
+            return 1;
+        memcpy(fds, CMSG_DATA(c), sizeof(fds));
+        memcpy(&req, buf, sizeof(req));
+        buf[n] = '\0';
+
+        // unpack the fd actions and strings in the order pool_spawn put them
+        fdact_t acts[req.nacts + 1];
+        int nopen = 0;
+        memcpy(acts, buf + sizeof(req), req.nacts * sizeof(fdact_t));
+        for (int i = 0; i < req.nacts; i++)
+            nopen += (acts[i].op == FD_OPEN);
+        char *strs[2 + nopen + req.argc + 1 + req.envc + 1];
+        char *p = buf + sizeof(req) + req.nacts * sizeof(fdact_t);
+        int k = 0;
+        for (int i = 0; i < 2 + nopen + req.argc; i++, p += strlen(p) + 1)
+            strs[k++] = p;
+        strs[k++] = NULL;
+        for (int i = 0; i < req.envc; i++, p += strlen(p) + 1)
+            strs[k++] = p;
+        strs[k] = NULL;
+
+        for (int i = 0, j = 2; i < req.nacts; i++)
+            acts[i].path = (acts[i].op == FD_OPEN) ? strs[j++] : NULL;
+        cmd.acts = acts;
+        cmd.nacts = req.nacts;
+        cmd.argv = &strs[2 + nopen];
+        cmd.argc = req.argc;
+        cmd.place = req.hasplace ? &req.place : NULL;
+        cmd.limit = req.haslimit ? &req.limit : NULL;
+
+        // a child of the shell, not of the helper
+        pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, NULL, NULL, NULL, NULL);
+        if (pid == 0)
+            pool_child(&req, strs[0], strs[1], &cmd, &cmd.argv[req.argc + 1], fds);
+        if (pid < 0)
+            pid = -errno;
+        for (int fd = 0; fd < 3; fd++)
+            close(fds[fd]);
+        if (send(sock, &pid, sizeof(pid), MSG_NOSIGNAL) != sizeof(pid))
+            return 1;
+    }
+}
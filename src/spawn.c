@@ -0,0 +1,189 @@
+/*
+ * spawn - start the process for one command
+ * either by fork + exec (the default), by posix_spawn,
+ * which glibc runs on a CLONE_VM | CLONE_VFORK child
+ * so no page tables of the shell are copied, or by the
+ * launch pool helper (pool.c)
+ *
+ * @author Monthon Paul
+ * @version March 11, 2024
+ */
+#include "mpsh.h"
+
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern char **environ;
+
+int launch_mode = LAUNCH_FORK; /* how mpsh_spawn starts processes */
+int spawn_shellfd = -1;        /* the shell's end of a pipe it copies, kept from children */
+
+static char *launch_str[] = {"fork", "spawn", "pool"};
+
+/**
+ * @brief start cmd with fork, set it up in the child and exec.
+ */
+static pid_t spawn_fork(cmd_t *cmd, char *path, int in, int out, pid_t pgid, sigset_t sigs) {
+    pid_t pid;
+
+    if ((pid = fork()) == 0) {
+        // need to unblock before exec call
+        sigprocmask(SIG_UNBLOCK, &sigs, NULL);
+        signal(SIGTTOU, SIG_DFL);
+        setpgid(0, pgid);
+        // a builtin never execs, so close-on-exec won't drop it and the copy never ends
+        if (spawn_shellfd != -1)
+            close(spawn_shellfd);
+        // _exit: the shell's atexit handlers are not the child's
+        if (place_apply(cmd->place) == -1 || limit_apply(cmd->limit) == -1)
+            _exit(EXIT_FAILURE);
+
+        if (in != -1)
+            dup2(in, STDIN_FILENO);
+        if (out != -1)
+            dup2(out, STDOUT_FILENO);
+        if (mpsh_redirect(cmd) == -1)
+            _exit(EXIT_FAILURE);
+        trace_mark(path ? "exec" : "builtin", getpid(), 0, *cmd->argv);
+        if (path == NULL)
+            mpsh_builtin_child(cmd);
+        hash_exec(path, cmd->argv);
+        printf("%s: Command not found\n", *cmd->argv);
+        fflush(stdout);
+        _exit(EXIT_FAILURE);
+    }
+    if (pid < 0)
+        perror("mpsh: fork");
+    return pid;
+}
+
+/**
+ * @brief start cmd with posix_spawn, with the pipe wiring and
+ * redirections done as file actions in the child.
+ */
+static pid_t spawn_posix(cmd_t *cmd, char *path, int in, int out, pid_t pgid) {
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    sigset_t mask, dfl;
+    pid_t pid;
+    int err;
+
+    posix_spawn_file_actions_init(&fa);
+    if (in != -1)
+        posix_spawn_file_actions_adddup2(&fa, in, STDIN_FILENO);
+    if (out != -1)
+        posix_spawn_file_actions_adddup2(&fa, out, STDOUT_FILENO);
+    for (int i = 0; i < cmd->nacts; i++) {
+        fdact_t *a = &cmd->acts[i];
+        if (a->op == FD_OPEN)
+            posix_spawn_file_actions_addopen(&fa, a->fd, a->path, a->flags, 0644);
+        else if (a->op == FD_DUP)
+            posix_spawn_file_actions_adddup2(&fa, a->src, a->fd);
+        else
+            posix_spawn_file_actions_addclose(&fa, a->fd);
+    }
+
+    // child starts in its process group, nothing blocked, default handlers
+    sigemptyset(&mask);
+    sigemptyset(&dfl);
+    sigaddset(&dfl, SIGINT);
+    sigaddset(&dfl, SIGTSTP);
+    sigaddset(&dfl, SIGCHLD);
+    sigaddset(&dfl, SIGTTOU);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK |
+                                        POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_USEVFORK);
+    posix_spawnattr_setpgroup(&attr, pgid);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setsigdefault(&attr, &dfl);
+
+    err = posix_spawn(&pid, path, &fa, &attr, cmd->argv, environ);
+    if (err == ENOENT && path != *cmd->argv && access(path, F_OK) == -1) {
+        // remembered binary went away, search $PATH again
+        hash_forget(*cmd->argv);
+        if ((path = hash_lookup(*cmd->argv)) != NULL)
+            err = posix_spawn(&pid, path, &fa, &attr, cmd->argv, environ);
+    }
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&fa);
+
+    if (err) {
+        if (err == ENOENT && !path)
+            printf("%s: Command not found\n", *cmd->argv);
+        else
+            fprintf(stderr, "mpsh: %s: %s\n", *cmd->argv, strerror(err));
+        return -1;
+    }
+    return pid;
+}
+
+/**
+ * @brief Start the process for a command, without waiting for it.
+ * @param cmd the command (program, arguments and redirections)
+ * @param path resolved program from hash_lookup, NULL for a builtin
+ * @param in fd to use as stdin, or -1 to inherit
+ * @param out fd to use as stdout, or -1 to inherit
+ * @param pgid process group to join, 0 to lead a new one
+ * @param sigs signals blocked by the caller, unblocked in the child
+ * @return the child pid, or -1 if it could not be started
+ */
+pid_t mpsh_spawn(cmd_t *cmd, char *path, int in, int out, pid_t pgid, sigset_t sigs) {
+    unsigned long long t = trace_now();
+    // builtins need a fork to run in, and so does placing or limiting the child
+    int posix = launch_mode == LAUNCH_SPAWN && path != NULL && cmd->place == NULL && cmd->limit == NULL;
+    pid_t pid;
+
+    // our buffered output goes first, and isn't copied into a fork
+    fflush(stdout);
+    // a forked or pool child can't drop a remembered binary that went away, look first
+    if (!posix && path != NULL && path != *cmd->argv && access(path, X_OK) == -1) {
+        hash_forget(*cmd->argv);
+        if ((path = hash_lookup(*cmd->argv)) == NULL) {
+            printf("%s: Command not found\n", *cmd->argv);
+            return -1;
+        }
+    }
+    if (posix) {
+        pid = spawn_posix(cmd, path, in, out, pgid);
+        trace_span("spawn", t, 0, *cmd->argv);
+    } else if (launch_mode == LAUNCH_POOL && path != NULL &&
+               (pid = pool_spawn(cmd, path, in, out, pgid)) != -2) {
+        trace_span("pool", t, 0, *cmd->argv);
+    } else {
+        pid = spawn_fork(cmd, path, in, out, pgid, sigs);
+        trace_span("fork", t, 0, *cmd->argv);
+    }
+
+    // also from the parent, so the group exists whoever runs first
+    if (pid > 0)
+        setpgid(pid, pgid ? pgid : pid);
+    return pid;
+}
+
+/**
+ * @brief builtin launch, show or pick how commands are started
+ * launch          print the current mode
+ * launch fork     fork + exec (default)
+ * launch spawn    posix_spawn
+ * launch pool     from a pre-started helper process
+ * @param ctx arguments (including program) and context.
+ * @return Always returns 1, to continue execution.
+ */
+int mpsh_launch_mode(builtin_ctx_t *ctx) {
+    char **args = ctx->argv;
+    if (!args[1]) {
+        printf("%s\n", launch_str[launch_mode]);
+        return 1;
+    }
+    for (int i = 0; i < sizeof(launch_str) / sizeof(char *); i++) {
+        if (!strcmp(args[1], launch_str[i])) {
+            launch_mode = i;
+            return 1;
+        }
+    }
+    fprintf(stderr, "launch: %s: expected fork, spawn or pool\n", args[1]);
+    last_status = 2;
+    return 1;
+}
@@ -0,0 +1,255 @@
+/*
+ * trace - timeline of what the shell and its children do
+ * spans (read, parse, resolve, spawn, wait, ...) and instants
+ * (exec, reap, stop) go to a ring in shared memory, so forked
+ * children log into it too, each writer claiming a slot with one
+ * atomic add; the ring is written out as Chrome Trace Event JSON
+ * (chrome://tracing, ui.perfetto.dev) at exit or by trace flush
+ *
+ * @author Monthon Paul
+ * @version March 11, 2024
+ */
+#include "mpsh.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define TRACE_ARG 48 /* bytes of argument kept per event */
+
+typedef struct trace_ev_t {
+    unsigned long seq;   /* slot index + 1 once written, 0 while being written */
+    unsigned long long ts, dur; /* ns, CLOCK_MONOTONIC */
+    const char *name;    /* a string literal, the same in forked children */
+    pid_t tid;           /* process the event is about */
+    int jid;             /* its job, 0 if none */
+    char ph;             /* 'X' span or 'i' instant */
+    char arg[TRACE_ARG];
+} trace_ev_t;
+
+typedef struct trace_ring_t {
+    unsigned long next;  /* slots ever claimed */
+    pid_t owner;         /* the shell, the only one to write the file */
+    trace_ev_t ev[];
+} trace_ring_t;
+
+int tracing;                 /* events are being recorded */
+static trace_ring_t *ring;   /* shared with the children */
+static char *trace_path;     /* JSON file */
+
+/**
+ * @brief Current time for the timeline.
+ * @return ns since boot, 0 when not tracing
+ */
+unsigned long long trace_now(void) {
+    struct timespec ts;
+
+    if (!tracing)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* trace_put - Claim the next slot and fill it in */
+static void trace_put(char ph, const char *name, unsigned long long start, pid_t tid,
+                      int jid, const char *arg) {
+    unsigned long i = __atomic_fetch_add(&ring->next, 1, __ATOMIC_RELAXED);
+    trace_ev_t *e = &ring->ev[i % MPSH_TRACE_EVENTS];
+    unsigned long long now = trace_now();
+
+    __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e->ph = ph;
+    e->name = name;
+    e->ts = start ? start : now;
+    e->dur = now - e->ts;
+    e->tid = tid;
+    e->jid = jid;
+    snprintf(e->arg, TRACE_ARG, "%s", arg ? arg : "");
+    e->arg[strcspn(e->arg, "\n")] = '\0';  // job command lines end in one
+    __atomic_store_n(&e->seq, i + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Record a span of the shell, from start to now.
+ * @param name what it was, a string literal
+ * @param start from trace_now
+ * @param jid job it was for, or 0
+ * @param arg detail, e.g. the command, or NULL
+ */
+void trace_span(const char *name, unsigned long long start, int jid, const char *arg) {
+    if (tracing)
+        trace_put('X', name, start, getpid(), jid, arg);
+}
+
+/**
+ * @brief Record a span of a child process, from start to now.
+ * @param name what it was, a string literal
+ * @param start from trace_now
+ * @param pid the child
+ * @param jid its job
+ * @param arg detail, or NULL
+ */
+void trace_proc(const char *name, unsigned long long start, pid_t pid, int jid, const char *arg) {
+    if (tracing)
+        trace_put('X', name, start, pid, jid, arg);
+}
+
+/**
+ * @brief Record something that happened at one point in time.
+ * @param name what happened, a string literal
+ * @param pid process it happened to
+ * @param jid its job, or 0
+ * @param arg detail, or NULL
+ */
+void trace_mark(const char *name, pid_t pid, int jid, const char *arg) {
+    if (tracing)
+        trace_put('i', name, 0, pid, jid, arg);
+}
+
+/* trace_exit - Write out a trace still on when the shell exits */
+static void trace_exit(void) {
+    if (tracing)
+        trace_stop();
+}
+
+/**
+ * @brief Start recording, into a new ring. The trace is written
+ * out at exit, unless it was turned off before.
+ * @param path JSON file to write
+ * @return 0 on success, -1 if the ring could not be mapped
+ */
+int trace_start(const char *path) {
+    size_t size = sizeof(trace_ring_t) + MPSH_TRACE_EVENTS * sizeof(trace_ev_t);
+    static int registered;
+
+    if (ring == NULL) {
+        ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (ring == MAP_FAILED) {
+            ring = NULL;
+            perror("mpsh: trace");
+            return -1;
+        }
+    }
+    ring->next = 0;
+    ring->owner = getpid();
+    free(trace_path);
+    trace_path = strdup(path);
+    tracing = 1;
+    if (!registered++)
+        atexit(trace_exit);
+    return 0;
+}
+
+/* trace_json - Write a string as a JSON string */
+static void trace_json(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(f, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(f, "\\u%04x", *s);
+        else
+            fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+/**
+ * @brief Write the events in the ring to the JSON file. Only the
+ * shell does, a forked child that exits is ignored.
+ * @return number of events written, or -1 on error
+ */
+int trace_flush(void) {
+    unsigned long end, first;
+    int n = 0;
+    FILE *f;
+
+    if (ring == NULL || trace_path == NULL || getpid() != ring->owner)
+        return 0;
+    if ((f = fopen(trace_path, "we")) == NULL) {
+        fprintf(stderr, "mpsh: %s: %s\n", trace_path, strerror(errno));
+        return -1;
+    }
+    end = __atomic_load_n(&ring->next, __ATOMIC_ACQUIRE);
+    first = (end > MPSH_TRACE_EVENTS) ? end - MPSH_TRACE_EVENTS : 0;
+
+    fprintf(f, "{\"traceEvents\":[\n");
+    fprintf(f, "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"tid\":%d,"
+               "\"args\":{\"name\":\"mpsh\"}}", ring->owner, ring->owner);
+    for (unsigned long i = first; i < end; i++) {
+        trace_ev_t *slot = &ring->ev[i % MPSH_TRACE_EVENTS], e;
+
+        // copy it, and drop it if it was being written meanwhile
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != i + 1)
+            continue;
+        e = *slot;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != i + 1)
+            continue;
+
+        e.arg[TRACE_ARG - 1] = '\0';
+        fprintf(f, ",\n{\"ph\":\"%c\",\"name\":", e.ph);
+        trace_json(f, e.name);
+        fprintf(f, ",\"pid\":%d,\"tid\":%d,\"ts\":%.3f", ring->owner, e.tid, e.ts / 1e3);
+        if (e.ph == 'X')
+            fprintf(f, ",\"dur\":%.3f", e.dur / 1e3);
+        else
+            fprintf(f, ",\"s\":\"t\"");
+        fprintf(f, ",\"args\":{\"jid\":%d,\"arg\":", e.jid);
+        trace_json(f, e.arg);
+        fprintf(f, "}}");
+        n++;
+    }
+    fprintf(f, "\n]}\n");
+    if (fclose(f) == EOF) {
+        fprintf(stderr, "mpsh: %s: %s\n", trace_path, strerror(errno));
+        return -1;
+    }
+    return n;
+}
+
+/**
+ * @brief Write the trace out and stop recording.
+ */
+void trace_stop(void) {
+    trace_flush();
+    tracing = 0;
+}
+
+/**
+ * @brief builtin trace, record a timeline of the shell
+ * trace            show whether it's on, and the events so far
+ * trace on FILE    start recording, to be written to FILE
+ * trace flush      write FILE now, recording goes on
+ * trace off        write FILE and stop recording
+ * @param ctx arguments (including program) and context.
+ * @return Always returns 1, to continue execution.
+ */
+int mpsh_trace(builtin_ctx_t *ctx) {
+    char **args = ctx->argv;
+    int n;
+
+    if (!args[1]) {
+        if (tracing)
+            printf("on, %lu events, to %s\n", ring->next, trace_path);
+        else
+            printf("off\n");
+    } else if (!strcmp(args[1], "on") && args[2]) {
+        if (trace_start(args[2]) == -1)
+            last_status = 1;
+    } else if (!strcmp(args[1], "flush") && tracing) {
+        if ((n = trace_flush()) == -1)
+            last_status = 1;
+        else
+            printf("trace: %d events to %s\n", n, trace_path);
+    } else if (!strcmp(args[1], "off")) {
+        if (tracing)
+            trace_stop();
+    } else {
+        printf("usage: trace [on FILE | flush | off]\n");
+        last_status = 2;
+    }
+    return 1;
+}
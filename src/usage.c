@@ -0,0 +1,192 @@
+/*
+ * usage - what jobs cost
+ * the rusage wait4 reports for each process is summed per job,
+ * shown by the time keyword and jobs, and summed again per
+ * session for the times builtin and the summary at exit
+ *
+ * @author Monthon Paul
+ * @version March 11, 2024
+ */
+#include "mpsh.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct hot_t { /* One of the costliest jobs of the session */
+    char *cmdline;
+    double cpu;        /* user + sys seconds */
+    long maxrss;       /* KiB */
+} hot_t;
+
+static struct rusage session;      /* every finished job, summed */
+static int ndone;                  /* jobs finished */
+static hot_t hot[MPSH_USAGE_TOP];  /* costliest jobs, unsorted */
+static struct rusage fgusage;      /* last foreground job to finish */
+
+/* tv2sec - A timeval in seconds */
+static double tv2sec(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* cpusec - user + sys seconds of a rusage */
+static double cpusec(struct rusage *ru) {
+    return tv2sec(ru->ru_utime) + tv2sec(ru->ru_stime);
+}
+
+/* elapsed - Seconds since a CLOCK_MONOTONIC time */
+double elapsed(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * @brief Add the resources of a process to a sum. Times and counts
+ * add up, maxrss is the largest of any one process.
+ * @param sum the sum
+ * @param ru what wait4 reported
+ */
+void usage_add(struct rusage *sum, struct rusage *ru) {
+    timeradd(&sum->ru_utime, &ru->ru_utime, &sum->ru_utime);
+    timeradd(&sum->ru_stime, &ru->ru_stime, &sum->ru_stime);
+    if (ru->ru_maxrss > sum->ru_maxrss)
+        sum->ru_maxrss = ru->ru_maxrss;
+    sum->ru_minflt += ru->ru_minflt;
+    sum->ru_majflt += ru->ru_majflt;
+    sum->ru_inblock += ru->ru_inblock;
+    sum->ru_oublock += ru->ru_oublock;
+    sum->ru_nvcsw += ru->ru_nvcsw;
+    sum->ru_nivcsw += ru->ru_nivcsw;
+}
+
+/**
+ * @brief Account for a job that has finished, before it is deleted.
+ * @param job the job
+ */
+void usage_done(job_t *job) {
+    hot_t *min = &hot[0];
+    double cpu = cpusec(&job->ru);
+
+    usage_add(&session, &job->ru);
+    ndone++;
+    if (job->state == FG)
+        fgusage = job->ru;
+
+    // replace a free slot, or else the cheapest job if this one cost more
+    for (int i = 1; i < MPSH_USAGE_TOP; i++)
+        if (min->cmdline && (!hot[i].cmdline || hot[i].cpu < min->cpu))
+            min = &hot[i];
+    if (min->cmdline && cpu <= min->cpu)
+        return;
+    free(min->cmdline);
+    min->cmdline = strdup(job->cmdline);
+    min->cpu = cpu;
+    min->maxrss = job->ru.ru_maxrss;
+}
+
+/**
+ * @brief What a job has used so far: its finished processes,
+ * and from /proc the CPU time and size of those still alive.
+ * @param job the job
+ * @param ru receives the sum
+ */
+void usage_live(job_t *job, struct rusage *ru) {
+    long tick = sysconf(_SC_CLK_TCK), kpage = sysconf(_SC_PAGESIZE) / 1024;
+
+    *ru = job->ru;
+    for (int i = 0; i < job->nprocs; i++) {
+        struct rusage p = {0};
+        unsigned long ut, st;
+        long rss;
+        char path[32], buf[1024], *s;
+        FILE *f;
+
+        if (job->procs[i].state == P_DONE)
+            continue;
+        snprintf(path, sizeof(path), "/proc/%d/stat", job->procs[i].pid);
+        if ((f = fopen(path, "re")) == NULL)
+            continue;
+        s = fgets(buf, sizeof(buf), f);
+        fclose(f);
+        // the fields after the command name, which may hold anything but ')'
+        if (s == NULL || (s = strrchr(buf, ')')) == NULL ||
+            sscanf(s + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu "
+                          "%*d %*d %*d %*d %*d %*d %*u %*u %ld", &ut, &st, &rss) != 3)
+            continue;
+        p.ru_utime.tv_sec = ut / tick;
+        p.ru_utime.tv_usec = ut % tick * 1000000 / tick;
+        p.ru_stime.tv_sec = st / tick;
+        p.ru_stime.tv_usec = st % tick * 1000000 / tick;
+        p.ru_maxrss = rss * kpage;
+        usage_add(ru, &p);
+    }
+}
+
+/**
+ * @brief Start timing a command for the time keyword.
+ * @param mark receives the start
+ */
+void usage_start(usage_mark_t *mark) {
+    clock_gettime(CLOCK_MONOTONIC, &mark->start);
+    getrusage(RUSAGE_SELF, &mark->self);
+    memset(&fgusage, 0, sizeof(fgusage));
+}
+
+/**
+ * @brief Report what a timed command used: its job, and the shell
+ * itself for builtins and the cat stages it does.
+ * @param mark from usage_start
+ */
+void usage_report(usage_mark_t *mark) {
+    struct rusage self, ru = fgusage;
+
+    getrusage(RUSAGE_SELF, &self);
+    timersub(&self.ru_utime, &mark->self.ru_utime, &self.ru_utime);
+    timersub(&self.ru_stime, &mark->self.ru_stime, &self.ru_stime);
+    self.ru_maxrss = 0;  // the shell's own peak isn't the command's
+    self.ru_nvcsw -= mark->self.ru_nvcsw;
+    self.ru_nivcsw -= mark->self.ru_nivcsw;
+    self.ru_minflt = self.ru_majflt = self.ru_inblock = self.ru_oublock = 0;
+    usage_add(&ru, &self);
+
+    fflush(stdout);
+    fprintf(stderr, "real\t%.3fs\nuser\t%.3fs\nsys\t%.3fs\n", elapsed(&mark->start),
+            tv2sec(ru.ru_utime), tv2sec(ru.ru_stime));
+    fprintf(stderr, "maxrss\t%ldK\nctxsw\t%ld voluntary, %ld involuntary\n",
+            ru.ru_maxrss, ru.ru_nvcsw, ru.ru_nivcsw);
+}
+
+/* hotcmp - Costliest job first, free slots last */
+static int hotcmp(const void *a, const void *b) {
+    const hot_t *x = a, *y = b;
+    if (!x->cmdline || !y->cmdline)
+        return !x->cmdline - !y->cmdline;
+    return (y->cpu > x->cpu) - (y->cpu < x->cpu);
+}
+
+/**
+ * @brief Print what the jobs of the session used, and the costliest ones.
+ * @param f where to
+ */
+void usage_summary(FILE *f) {
+    hot_t sorted[MPSH_USAGE_TOP];
+
+    fprintf(f, "%d jobs, user %.3fs, sys %.3fs, maxrss %ldK, ctxsw %ld/%ld\n", ndone,
+            tv2sec(session.ru_utime), tv2sec(session.ru_stime), session.ru_maxrss,
+            session.ru_nvcsw, session.ru_nivcsw);
+    memcpy(sorted, hot, sizeof(hot));
+    qsort(sorted, MPSH_USAGE_TOP, sizeof(hot_t), hotcmp);
+    for (int i = 0; i < MPSH_USAGE_TOP && sorted[i].cmdline; i++)
+        fprintf(f, "%8.3fs %8ldK  %s", sorted[i].cpu, sorted[i].maxrss, sorted[i].cmdline);
+}
+
+/**
+ * @brief builtin times, what the jobs of the session have used
+ * @param ctx arguments (including program) and context.
+ * @return Always returns 1, to continue execution.
+ */
+int mpsh_times(builtin_ctx_t *ctx) {
+    usage_summary(stdout);
+    return 1;
+}
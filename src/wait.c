@@ -0,0 +1,219 @@
+/*
+ * wait - block until background jobs finish
+ * each job is watched through a pidfd of one of its live processes,
+ * all in one epoll set, so the shell sleeps until a watched process
+ * exits, and a wakeup only looks at those that did. Exits are still
+ * reaped by sigchld_handler, so the job list, and what jobs shows,
+ * is the one place a job's state and status are kept
+ *
+ * @author Monthon Paul
+ * @version March 11, 2024
+ */
+#include "mpsh.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+
+typedef struct waiter_t { /* A job being waited for */
+    job_t *job;           /* valid while status is -1 */
+    int status;           /* exit status once done (through job->done), -1 before */
+    int fd;               /* pidfd of one of its live processes, -1 if none */
+    int unknown;          /* the argument named no job */
+    int same;             /* index of the waiter for the same job, or -1 */
+} waiter_t;
+
+/* wait_watch - Watch a live process of w's job; -1 if there is none to watch */
+static int wait_watch(waiter_t *w, int ep) {
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = w};
+    job_t *job = w->job;
+
+    if (w->fd != -1)
+        close(w->fd);
+    w->fd = -1;
+    // the last stage first, it gives the job its status
+    for (int i = job->nprocs - 1; i >= 0; i--) {
+        if (job->procs[i].state == P_DONE)
+            continue;
+        if ((w->fd = syscall(SYS_pidfd_open, job->procs[i].pid, 0)) == -1) {
+            if (errno == ESRCH)
+                continue;  // gone already, the reap is on its way
+            return -1;
+        }
+        if (epoll_ctl(ep, EPOLL_CTL_ADD, w->fd, &ev) == 0)
+            return 0;
+        close(w->fd);
+        w->fd = -1;
+        return -1;
+    }
+    return -1;
+}
+
+/* wait_nofile - Let the shell hold as many pidfds as the hard limit allows */
+static void wait_nofile(int n) {
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < n + 64 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = (rl.rlim_max == RLIM_INFINITY || rl.rlim_max > n + 64) ? n + 64 : rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+/* wait_poll - Look at the jobs without a pidfd on every SIGCHLD too */
+static void wait_poll(int sfd, sigset_t *mask, int *polled) {
+    if ((*polled)++ == 0) {
+        sigaddset(mask, SIGCHLD);
+        signalfd(sfd, mask, 0);
+    }
+}
+
+/**
+ * @brief Wait for the jobs of ws to finish, or for the first of them with any.
+ * A job with no process to watch (out of descriptors) is looked at on
+ * every SIGCHLD instead.
+ * @param ws the jobs
+ * @param n how many
+ * @param any return once one of them is done
+ * @return the waiter that finished last (or first, with any), NULL if
+ *         interrupted by ctrl-c
+ */
+static waiter_t *wait_jobs(waiter_t *ws, int n, int any) {
+    struct epoll_event evs[64], sev = {.events = EPOLLIN, .data.ptr = NULL};
+    waiter_t *last = NULL;
+    sigset_t mask;
+    int ep, sfd = -1, left = 0, polled = 0, k;
+
+    // ctrl-c ends the wait; SIGCHLD only matters for jobs without a pidfd
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    if ((ep = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+        (sfd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK)) == -1 ||
+        epoll_ctl(ep, EPOLL_CTL_ADD, sfd, &sev) == -1)
+        unix_error("wait setup error");
+
+    wait_nofile(n);
+    for (int i = 0; i < n; i++) {
+        if (ws[i].job == NULL)
+            continue;
+        left++;
+        ws[i].job->done = &ws[i].status;
+        if (wait_watch(&ws[i], ep) == -1)
+            wait_poll(sfd, &mask, &polled);
+    }
+
+    jobs.sigint = 0;
+    while (left > 0 && !(any && last) && !jobs.sigint) {
+        while ((k = epoll_wait(ep, evs, 64, -1)) < 0 && errno == EINTR) {
+        }
+        if (k < 0)
+            unix_error("epoll_wait error");
+        sigchld_handler(SIGCHLD);  // reap what exited, the jobs get their status
+        for (int e = 0; e < k; e++) {
+            waiter_t *w = evs[e].data.ptr;
+            if (w == NULL) {
+                struct signalfd_siginfo si;
+                while (read(sfd, &si, sizeof(si)) == sizeof(si)) {
+                    if (si.ssi_signo == SIGINT)
+                        jobs.sigint = 1;
+                }
+                // no pidfd: look at each, only when a child exited
+                for (int i = 0; polled && i < n; i++) {
+                    if (ws[i].fd == -1 && ws[i].job && ws[i].status != -1) {
+                        ws[i].job = NULL;
+                        last = &ws[i];
+                        left--;
+                    }
+                }
+            } else if (w->status != -1) {
+                close(w->fd);
+                w->fd = -1;
+                w->job = NULL;
+                last = w;
+                left--;
+            } else if (wait_watch(w, ep) == -1) {
+                wait_poll(sfd, &mask, &polled);  // an earlier stage still runs
+            }
+        }
+    }
+
+    // those still running are no longer watched
+    for (int i = 0; i < n; i++) {
+        if (ws[i].fd != -1)
+            close(ws[i].fd);
+        if (ws[i].job && ws[i].status == -1)
+            ws[i].job->done = NULL;
+    }
+    close(sfd);
+    close(ep);
+    return jobs.sigint ? NULL : last;
+}
+
+/**
+ * @brief builtin wait, block until background jobs finish
+ * wait                 every job, status 0
+ * wait %jid|pid ...    those jobs, status of the last one
+ * wait -n [%jid|pid ...]  the first of them (or of every job) to finish, its status
+ * A job that doesn't exist gives 127, ctrl-c stops waiting with 130.
+ * @param ctx arguments (including program) and context.
+ * @return Always returns 1, to continue execution.
+ */
+int mpsh_wait(builtin_ctx_t *ctx) {
+    char **args = ctx->argv + 1;
+    int any = 0, n = 0, all;
+    waiter_t *ws, *w;
+
+    if (*args && !strcmp(*args, "-n")) {
+        any = 1;
+        args++;
+    }
+    all = (*args == NULL);
+    // in a pipeline stage, the jobs aren't this process's children
+    if (ctx->forked) {
+        last_status = all ? 0 : 127;
+        return 1;
+    }
+    if ((ws = calloc(all ? jobs.njobs + 1 : ctx->argc, sizeof(waiter_t))) == NULL) {
+        fprintf(stderr, "mpsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    if (all) {
+        // a stopped job would never finish
+        for (int jid = 1; jid < jobs.jidcap; jid++)
+            if (jobs.byjid[jid] && jobs.byjid[jid]->state != ST)
+                ws[n++] = (waiter_t){jobs.byjid[jid], -1, -1, 0, -1};
+    }
+    for (; *args; args++, n++) {
+        job_t *job = (**args == '%') ? getjobjid(&jobs, atoi(*args + 1))
+                                     : getjobpid(&jobs, atoi(*args));
+        ws[n] = (waiter_t){job, -1, -1, job == NULL, -1};
+        if (job == NULL)
+            fprintf(stderr, "wait: %s: no such job\n", *args);
+        // the same job twice is waited for once
+        for (int i = 0; job && i < n; i++) {
+            if (ws[i].job == job) {
+                ws[n].job = NULL;
+                ws[n].same = i;
+            }
+        }
+    }
+
+    w = wait_jobs(ws, n, any);
+    for (int i = 0; i < n; i++)
+        if (ws[i].same != -1)
+            ws[i].status = ws[ws[i].same].status;
+    if (jobs.sigint)
+        last_status = 128 + SIGINT;
+    else if (any)
+        last_status = w ? w->status : 127;
+    else if (all)
+        last_status = 0;
+    else if (ws[n - 1].unknown)
+        last_status = 127;
+    else
+        last_status = ws[n - 1].status;
+    free(ws);
+    return 1;
+}